@@ -0,0 +1,363 @@
+/*
+================================================================================
+
+	bench - microbenchmarks for delve against a loopback gopher server
+    Copyright (C) 2019  Sebastian Steinhauer
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+================================================================================
+*/
+/*============================================================================*/
+#ifdef __linux__
+	#define _GNU_SOURCE /* splice() */
+#endif /* __linux__ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+/* count the allocations of delve, the prototypes above stay untouched */
+size_t allocations = 0;
+
+void *bench_malloc(size_t size) { ++allocations; return malloc(size); }
+void *bench_calloc(size_t count, size_t size) { ++allocations; return calloc(count, size); }
+void *bench_realloc(void *ptr, size_t size) { ++allocations; return realloc(ptr, size); }
+char *bench_strdup(const char *str) { ++allocations; return strdup(str); }
+
+#define malloc bench_malloc
+#define calloc bench_calloc
+#define realloc bench_realloc
+#define strdup bench_strdup
+#define main delve_main
+#include "delve.c"
+#undef main
+#undef malloc
+#undef calloc
+#undef realloc
+#undef strdup
+
+
+/*============================================================================*/
+typedef struct Bench {
+	const char *name;
+	long long started;
+	size_t allocations;
+	long iterations;
+} Bench;
+
+int server_port = 0;
+pid_t server_pid = -1;
+int quiet_fd = -1; /* /dev/null, the output of delve goes there */
+int saved_fd = -1;
+double min_time = 0.25; /* seconds every benchmark runs at least */
+
+
+/*============================================================================*/
+/* responses are chosen by the selector: /menu/<items>, /text/<bytes> and /trickle/<bytes> */
+void serve(int client) {
+	char request[1024], block[1024 * 64];
+	size_t length = 0, chunk;
+	unsigned long size;
+	ssize_t received;
+	long i, count;
+	int trickle;
+
+	while (length < sizeof(request) - 1 && (received = recv(client, request + length, sizeof(request) - 1 - length, 0)) > 0) {
+		length += received;
+		request[length] = '\0';
+		if (strchr(request, '\n')) break;
+	}
+	request[length] = '\0';
+
+	if (sscanf(request, "/menu/%ld", &count) == 1) {
+		for (i = 0, length = 0; i < count; ++i) {
+			if (i % 10 == 0) length += snprintf(block + length, sizeof(block) - length, "iinformation line %ld\t\terror.host\t1\r\n", i);
+			else length += snprintf(block + length, sizeof(block) - length, "1Directory number %ld of the synthetic menu\t/menu/%ld\t127.0.0.1\t%d\r\n", i, i, server_port);
+			if (length > sizeof(block) - 256) { write_all(client, block, length); length = 0; }
+		}
+		length += snprintf(block + length, sizeof(block) - length, ".\r\n");
+		write_all(client, block, length);
+	} else if (sscanf(request, "/text/%lu", &size) == 1 || sscanf(request, "/trickle/%lu", &size) == 1) {
+		trickle = request[1] == 't' && request[2] == 'r';
+		for (i = 0; i < (long)sizeof(block); ++i) block[i] = i % 64 == 63 ? '\n' : 'a' + i % 26;
+		for (; size > 0; size -= chunk) {
+			chunk = size < (trickle ? 1024 : sizeof(block)) ? size : (trickle ? 1024 : sizeof(block));
+			if (!write_all(client, block, chunk)) break;
+			if (trickle) usleep(1000);
+		}
+	}
+	close(client);
+}
+
+
+void start_server() {
+	struct sockaddr_in addr;
+	socklen_t length = sizeof(addr);
+	int fd, client, on = 1;
+
+	if ((fd = socket(AF_INET, SOCK_STREAM, 0)) == -1) panic("cannot create server socket");
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) || listen(fd, 64)) panic("cannot listen on loopback");
+	getsockname(fd, (struct sockaddr*)&addr, &length);
+	server_port = ntohs(addr.sin_port);
+
+	if ((server_pid = fork()) == -1) panic("cannot start server");
+	if (server_pid == 0) {
+		signal(SIGPIPE, SIG_IGN);
+		while ((client = accept(fd, NULL, NULL)) != -1 || errno == EINTR) if (client != -1) serve(client);
+		_exit(EXIT_SUCCESS);
+	}
+	close(fd);
+}
+
+
+void stop_server() {
+	if (server_pid > 0) {
+		kill(server_pid, SIGTERM);
+		waitpid(server_pid, NULL, 0);
+	}
+}
+
+
+/*============================================================================*/
+/* the benchmarks write into /dev/null, the results go to the real stdout */
+void mute() {
+	fflush(stdout);
+	saved_fd = dup(STDOUT_FILENO);
+	dup2(quiet_fd, STDOUT_FILENO);
+}
+
+
+void unmute() {
+	fflush(stdout);
+	dup2(saved_fd, STDOUT_FILENO);
+	close(saved_fd);
+}
+
+
+void begin(Bench *bench, const char *name) {
+	mute();
+	bench->name = name;
+	bench->iterations = 0;
+	bench->allocations = allocations;
+	bench->started = now_us();
+}
+
+
+/* keeps the benchmark running until it took long enough to be measured */
+int running(Bench *bench) {
+	return bench->iterations++ == 0 || now_us() - bench->started < min_time * 1000000;
+}
+
+
+/* one JSON object per line, so the results can be compared across releases */
+void report(Bench *bench, double items, double bytes) {
+	struct rusage usage;
+	double seconds = (now_us() - bench->started) / 1000000.0;
+	long iterations = bench->iterations - 1; /* running() counts the check which ended the loop */
+	long rss;
+
+	unmute();
+	getrusage(RUSAGE_SELF, &usage);
+#ifdef __APPLE__
+	rss = usage.ru_maxrss / 1024; /* bytes on macOS */
+#else
+	rss = usage.ru_maxrss;
+#endif /* __APPLE__ */
+	if (iterations < 1) iterations = 1;
+	printf("{\"bench\":\"%s\",\"iterations\":%ld,\"seconds\":%.6f,\"items_per_s\":%.1f,\"mb_per_s\":%.2f,"
+		"\"allocations\":%.1f,\"peak_rss_kb\":%ld}\n",
+		bench->name, iterations, seconds / iterations, items * iterations / seconds,
+		bytes * iterations / seconds / (1024.0 * 1024.0),
+		(double)(allocations - bench->allocations) / iterations, rss);
+	fflush(stdout);
+}
+
+
+void make_selector(Selector *sel, char type, const char *path) {
+	char port[16];
+	snprintf(port, sizeof(port), "%d", server_port);
+	sel->index = 1;
+	sel->type = type;
+	sel->name = str_copy(path);
+	sel->host = intern_string("127.0.0.1");
+	sel->port = intern_string(port);
+	sel->path = str_copy(path);
+}
+
+
+#ifdef DELVE_USE_READLINE
+void free_matches(char **matches) {
+	char **match;
+	if (matches == NULL) return;
+	for (match = matches; *match; ++match) free(*match);
+	free(matches);
+}
+#endif /* DELVE_USE_READLINE */
+
+
+/*============================================================================*/
+void bench_menu(long items) {
+	char name[64], path[64];
+	SelectorList list;
+	Selector sel;
+	Buffer buf, copy;
+	Bench bench;
+
+	snprintf(path, sizeof(path), "/menu/%ld", items);
+	make_selector(&sel, '1', path);
+	mute();
+	if (download(&sel, NULL, &buf) == NULL) panic("cannot download `%s`", path);
+	unmute();
+
+	snprintf(name, sizeof(name), "download menu %ld", items);
+	for (begin(&bench, name); running(&bench); ) {
+		if (download(&sel, NULL, &copy) == NULL) panic("cannot download `%s`", path);
+		free_buffer(&copy);
+	}
+	report(&bench, items, buf.length);
+
+	snprintf(name, sizeof(name), "parse menu %ld", items);
+	for (begin(&bench, name); running(&bench); ) {
+		parse_selector_list(&list, buf.data, buf.length);
+		free_selector_list(&list);
+	}
+	report(&bench, items, buf.length);
+
+	/* rendering into /dev/null is the cost of formatting and writing the menu */
+	parse_selector_list(&list, buf.data, buf.length);
+	snprintf(name, sizeof(name), "print menu %ld", items);
+	for (begin(&bench, name); running(&bench); ) print_menu(&list, NULL, NULL);
+	report(&bench, items, buf.length);
+
+	snprintf(name, sizeof(name), "filter menu %ld", items);
+	for (begin(&bench, name); running(&bench); ) {
+		list.generation = ++list_generation; /* defeat the match cache */
+		match_selectors(&list, "number 4");
+	}
+	report(&bench, items, buf.length);
+
+#ifdef DELVE_USE_READLINE
+	menu = list;
+	snprintf(name, sizeof(name), "index menu %ld", items);
+	for (begin(&bench, name); running(&bench); ) {
+		menu.generation = ++list_generation; /* build the completion index again */
+		free_matches(complete_line("see directory number 4321", 25));
+	}
+	report(&bench, items, buf.length);
+
+	snprintf(name, sizeof(name), "complete menu %ld", items);
+	for (begin(&bench, name); running(&bench); ) free_matches(complete_line("see directory number 4321", 25));
+	report(&bench, 1, 0); /* a lookup doesn't touch every item, so count the completions */
+	init_selector_list(&menu, 0);
+#endif /* DELVE_USE_READLINE */
+
+	free_selector_list(&list);
+	free_buffer(&buf);
+	free_selector(&sel);
+}
+
+
+void bench_text(const char *kind, size_t size) {
+	char name[64], path[64];
+	Selector sel;
+	Buffer buf;
+	Bench bench;
+
+	snprintf(path, sizeof(path), "/%s/%lu", kind, (unsigned long)size);
+	snprintf(name, sizeof(name), "download %s %lu", kind, (unsigned long)size);
+	make_selector(&sel, '0', path);
+	/* large bodies go to /dev/null like a saved file, they would not fit into memory */
+	for (begin(&bench, name); running(&bench); ) {
+		if (size > 1024 * 1024 * 64) {
+			if (!download_to_fd(&sel, quiet_fd)) panic("cannot download `%s`", path);
+		} else {
+			if (download(&sel, NULL, &buf) == NULL) panic("cannot download `%s`", path);
+			free_buffer(&buf);
+		}
+	}
+	report(&bench, 1, size);
+	free_selector(&sel);
+}
+
+
+void bench_eval() {
+	Buffer script;
+	Bench bench;
+	int i;
+
+	init_buffer(&script);
+	for (i = 0; i < 1000; ++i) {
+		script.length += snprintf(reserve_buffer(&script, 64), 64, "set BENCH_%d %d\nbench_alias\n", i % 50, i);
+	}
+	set_var(&aliases, "bench_alias", "set BENCH_ALIAS \"$BENCH_1\"");
+	for (begin(&bench, "eval 2000 statements"); running(&bench); ) eval(script.data, NULL);
+	report(&bench, 2000, script.length);
+	free_buffer(&script);
+}
+
+
+/*============================================================================*/
+int main(int argc, char **argv) {
+	int i, large = 0;
+
+	for (i = 1; i < argc; ++i) {
+		if (!strcmp(argv[i], "-l")) large = 1; /* include the 1 GB body */
+		else if (!strcmp(argv[i], "-q")) min_time = 0.01; /* quick run, e.g. to check it still works */
+		else {
+			fprintf(stderr, "usage: bench [-l] [-q]\n");
+			return EXIT_FAILURE;
+		}
+	}
+
+	init_fold();
+	signal(SIGPIPE, SIG_IGN);
+	if ((quiet_fd = open("/dev/null", O_WRONLY)) == -1) panic("cannot open /dev/null");
+	set_var(&variables, "CACHE_DIRECTORY", "%s", ""); /* never touch the real caches */
+	set_var(&variables, "DATA_DIRECTORY", "%s", "");
+	set_var(&variables, "PAGE_TEXT", "off");
+	start_server();
+
+	bench_menu(10);
+	bench_menu(1000);
+	bench_menu(100000);
+	bench_text("text", 1024);
+	bench_text("text", 1024 * 1024);
+	bench_text("text", 1024 * 1024 * 64);
+	if (large) bench_text("text", 1024 * 1024 * 1024);
+	bench_text("trickle", 1024 * 64);
+	bench_eval();
+
+	stop_server();
+	close(quiet_fd);
+	free_variable(&variables);
+	free_variable(&aliases);
+	free_set(&command_names);
+#ifdef DELVE_USE_READLINE
+	free_completions(&command_completions);
+	free_completions(&topic_completions);
+	free_completions(&menu_completions);
+#endif /* DELVE_USE_READLINE */
+	free_host(hosts);
+	free_buffer(&screen);
+	free(matches.items);
+	free_strings();
+	return EXIT_SUCCESS;
+}
+/* vim: set ts=4 sw=4 noexpandtab: */
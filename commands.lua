@@ -1,7 +1,7 @@
 -- just a simple script to create the help content for `commands`
 local commands = {
 	"quit", "open", "show", "save", "back", "help", "history", "bookmarks",
-	"set", "see", "alias", "type",
+	"set", "see", "alias", "type", "mirror", "find", "stats",
 }
 table.sort(commands)
 for i, name in ipairs(commands) do
@@ -20,18 +20,31 @@
 ================================================================================
 */
 /*============================================================================*/
+#ifdef __linux__
+	#define _GNU_SOURCE /* splice() */
+#endif /* __linux__ */
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdarg.h>
 #include <string.h>
 #include <ctype.h>
 #include <errno.h>
+#include <time.h>
+#include <signal.h>
 
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/wait.h>
 #include <netdb.h>
+#include <poll.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <fcntl.h>
 #include <unistd.h>
 
 #ifdef DELVE_USE_READLINE
@@ -39,19 +52,278 @@
 	#include <readline/history.h>
 #endif /* DELVE_USE_READLINE */
 
+#ifdef DELVE_USE_TLS
+	#include <openssl/ssl.h>
+	#include <openssl/err.h>
+#endif /* DELVE_USE_TLS */
+
 
 /*============================================================================*/
 typedef struct Selector {
-	struct Selector *next;
 	int index;
-	char type, *name, *host, *port, *path;
+	char type, *name, *path;
+	const char *host, *port; /* interned, see intern() */
 } Selector;
 
+typedef struct Arena {
+	struct Arena *next;
+	size_t used, size;
+	char data[];
+} Arena;
+
+typedef struct SelectorList {
+	Selector *items;
+	int count, capacity;
+	int reverse; /* shown newest first, like the history */
+	Arena *arena; /* owns the strings, if NULL every selector owns its own */
+	int generation; /* changes with the contents, see match_selectors() */
+} SelectorList;
+
+typedef struct Matches {
+	const SelectorList *list;
+	int generation, count;
+	char filter[256]; /* lower case */
+	int *items, length, capacity;
+} Matches;
+
+typedef struct Statement {
+	const struct Command *cmd; /* NULL when `name` is an alias or a variable */
+	char *name, *args;
+	int line_no;
+} Statement;
+
+typedef struct Script {
+	Statement *statements;
+	int count, capacity;
+	int running, stale; /* a running script is freed once it is done */
+} Script;
+
 typedef struct Variable {
-	struct Variable *next;
+	struct Variable *next, *chain; /* `next` keeps the order of creation, `chain` links the hash bucket */
 	char *name, *data;
+	Script *script; /* the compiled data of an alias, see alias_script() */
+	int integer, is_integer, boolean; /* parsed once whenever the data changes */
 } Variable;
 
+typedef struct Table {
+	Variable *list, *buckets[64];
+	int generation; /* changes whenever a variable is set */
+} Table;
+
+typedef struct Cache {
+	struct Cache *next;
+	char *key;
+	SelectorList list;
+	size_t size;
+	time_t stamp;
+} Cache;
+
+typedef struct DiskEntry {
+	struct DiskEntry *next;
+	char *key;
+	size_t size;
+	time_t stamp;
+} DiskEntry;
+
+typedef struct Host {
+	struct Host *next;
+	const char *name, *port; /* interned */
+	struct addrinfo *addresses;
+	time_t stamp;
+} Host;
+
+#ifdef DELVE_USE_TLS
+typedef struct Session {
+	struct Session *next;
+	const char *host, *port; /* interned */
+	SSL_SESSION *session; /* the latest one the server gave us, NULL if it doesn't speak TLS */
+	int plain; /* the handshake failed, so plain text is used with TLS set to `auto` */
+} Session;
+#endif /* DELVE_USE_TLS */
+
+#ifdef DELVE_USE_READLINE
+typedef struct Completion {
+	const char *key; /* lower case */
+	const char *word; /* a name or URL */
+	int id; /* index + 1 of an item in its list, items are completed to it, 0 for words */
+} Completion;
+
+typedef struct CompletionIndex {
+	Completion *items; /* sorted by key, so a prefix is found by binary search */
+	int count, capacity;
+	int generation; /* of the source it was built from, -1 before */
+	Arena *arena; /* owns the keys and words */
+} CompletionIndex;
+
+typedef struct Found {
+	char **matches; /* for readline, the first one replaces the typed text */
+	int count, capacity;
+	int items; /* how many of them are items */
+} Found;
+#endif /* DELVE_USE_READLINE */
+
+typedef struct Buffer {
+	char *data;
+	size_t length, size;
+	int mapped;
+} Buffer;
+
+typedef struct Parser {
+	SelectorList *list;
+	size_t offset;
+	int ended;
+} Parser;
+
+typedef struct Address {
+	int family;
+	socklen_t length;
+	struct sockaddr_storage addr;
+} Address;
+
+enum { CONNECTING, HANDSHAKE, SENDING, RECEIVING, DONE, FAILED };
+
+typedef struct Transfer {
+	struct Transfer *next;
+	Selector sel;
+	char request[1024];
+	size_t sent, received;
+	int fd, state, quiet;
+	Address addresses[16]; /* connection attempts, see start_attempts() */
+	int attempts[16], tried, total, pending;
+	long started, deadline, timeout;
+	int first; /* first entry of this transfer in the poll fds */
+	size_t chunk; /* asked of each recv(), it grows while the reads fill it */
+	int quickack; /* TCP_QUICKACK has to be set again after every read */
+	int events; /* what the TLS handshake waits for */
+	int fast_open; /* the attempt which sent `early` bytes of the request with its SYN, see send_early() */
+	size_t early;
+#ifdef DELVE_USE_TLS
+	SSL *ssl;
+#endif /* DELVE_USE_TLS */
+	Buffer buf;
+	Parser *parser; /* NULL unless the response is a gopher menu */
+	int out, pipe[2]; /* write the response to `out` instead of the buffer */
+	size_t spill_at; /* move the response into a temporary file beyond this size, 0 keeps it in memory */
+	int temp; /* that temporary file, it is `out` as well */
+	void (*finish)(struct Transfer *t); /* set for background transfers, called once they are done */
+	void *data; /* the queue of a queued transfer */
+	long long created, resolved, established, first_byte; /* microseconds, see record_transfer() */
+} Transfer;
+
+typedef struct Text {
+	Transfer *t; /* still receiving the text, NULL once it has ended */
+	Buffer buf; /* the text in memory */
+	int fd; /* or the temporary file it has spilled into */
+	char *map; /* mapping of `fd`, grown as the file grows */
+	size_t map_length;
+	const char *data;
+	size_t length;
+	size_t *lines; /* start of every line, lines[count] is where the next one starts */
+	int count, capacity;
+	int ended, complete;
+} Text;
+
+typedef struct Queue {
+	SelectorList list;
+	int next, limit, host_limit; /* concurrent transfers overall and per host */
+	int done, failed;
+	size_t received; /* bytes of the finished transfers */
+	Transfer *(*start)(struct Queue *queue, Selector *sel);
+} Queue;
+
+typedef struct Set {
+	unsigned long long *slots; /* hashes of the members, 0 marks a free slot */
+	int *values;
+	size_t count, size;
+} Set;
+
+typedef struct Sample {
+	const char *host;
+	int failed;
+	size_t bytes;
+	long dns, connect, first_byte, transfer; /* microseconds */
+} Sample;
+
+typedef struct Stats {
+	Sample samples[256]; /* the most recent requests */
+	int count; /* requests so far, the next one goes to samples[count % 256] */
+	long long parse_time, render_time; /* microseconds */
+	size_t parsed; /* bytes of menus */
+	int rendered; /* menus */
+	int cache_hits, cache_misses, disk_hits, disk_misses;
+	int handshakes, resumed; /* TLS */
+} Stats;
+
+typedef struct Mirror {
+	Queue queue; /* must be the first member, the transfers point to it */
+	Set seen; /* hash of a cache key -> index into `keys` */
+	char **keys; /* the selectors mirrored already */
+	int key_count, key_capacity;
+	char directory[1024];
+	int depth;
+} Mirror;
+
+typedef struct Result {
+	Selector sel;
+	Buffer buf; /* the response, unless it went into a file */
+	int fd; /* the temporary file it spilled into or -1 */
+	int finished, failed;
+	size_t received;
+} Result;
+
+enum { BATCH_BACKLOG = 256 }; /* lines waiting to be written, reading stops beyond that */
+
+typedef struct Batch {
+	Queue queue; /* must be the first member, the transfers point to it */
+	Result results[BATCH_BACKLOG]; /* by sequence number, they are written in the order of the input */
+	int queued, written, failed;
+} Batch;
+
+enum { MAX_WORD = 32 };
+enum { DOC_LINK = '-', DOC_VISITED = '+', DOC_REPLACED = 'x' };
+
+typedef struct Term {
+	char *word;
+	unsigned char *postings; /* varint pairs of the document delta and the word count */
+	size_t length, size;
+	int last, pending, count; /* last document, count in the current document, documents */
+} Term;
+
+typedef struct Index {
+	SelectorList docs;
+	char *flags; /* one of DOC_LINK, DOC_VISITED or DOC_REPLACED for every document */
+	int flags_capacity;
+	Set keys; /* cache key of a selector -> its current document */
+	Term *terms;
+	int term_count, term_capacity;
+	Set words; /* word -> term */
+	int *touched; /* terms of the document being added */
+	int touched_count, touched_capacity;
+	int loaded, dirty;
+} Index;
+
+typedef struct Hit {
+	int doc;
+	double score;
+} Hit;
+
+typedef struct Log {
+	SelectorList *list;
+	const char *name;
+	int fd, first; /* entries before `first` come from the config files */
+	int records; /* lines in the file, including dropped entries */
+	int unique; /* entries are added with visit_selector() */
+} Log;
+
+typedef struct Navigation {
+	Selector to;
+	char key[1024];
+	SelectorList list;
+	Parser parser;
+	int add_to_history;
+	int generation; /* of the menu a refresh replaces, see refresh_done() */
+} Navigation;
+
 typedef struct Command {
 	const char *name;
 	void (*func)(char *line);
@@ -64,39 +336,106 @@ typedef struct Help {
 
 
 /*============================================================================*/
-Variable *variables = NULL;
-Variable *aliases = NULL;
-Variable *typehandlers = NULL;
-Selector *bookmarks = NULL;
-Selector *history = NULL;
-Selector *menu = NULL;
+Table variables = { NULL, { NULL }, 0 };
+Table aliases = { NULL, { NULL }, 0 };
+Table typehandlers = { NULL, { NULL }, 0 };
+SelectorList bookmarks = { NULL, 0, 0, 0, NULL, 1 };
+SelectorList history = { NULL, 0, 0, 1, NULL, 2 };
+SelectorList menu = { NULL, 0, 0, 0, NULL, 3 };
+Log bookmarks_log = { &bookmarks, "bookmarks", -1, 0, 0, 0 };
+Log history_log = { &history, "history", -1, 0, 0, 1 };
+Set history_index; /* hash of an entry -> its stamp, see visit_selector() */
+int *history_stamps, history_stamp; /* ascending, one for every entry of the history */
+int list_generation = 3;
+Matches matches = { NULL, 0, 0, "", NULL, 0, 0 };
+unsigned char fold[256]; /* lower case of every byte, see init_fold() */
+Set command_names; /* see find_command() */
+#ifdef DELVE_USE_READLINE
+/* rebuilt when their source changed since the last completion, see complete_line() */
+CompletionIndex command_completions = { NULL, 0, 0, -1, NULL };
+CompletionIndex topic_completions = { NULL, 0, 0, -1, NULL };
+CompletionIndex alias_completions = { NULL, 0, 0, -1, NULL };
+CompletionIndex variable_completions = { NULL, 0, 0, -1, NULL };
+CompletionIndex menu_completions = { NULL, 0, 0, -1, NULL };
+CompletionIndex history_completions = { NULL, 0, 0, -1, NULL };
+CompletionIndex bookmark_completions = { NULL, 0, 0, -1, NULL };
+#endif /* DELVE_USE_READLINE */
+Stats stats; /* see record_transfer() and cmd_stats() */
+#ifdef DELVE_USE_TLS
+SSL_CTX *tls = NULL; /* created once it is needed, see tls_context() */
+Session *sessions = NULL;
+int sessions_dirty = 0;
+#endif /* DELVE_USE_TLS */
+#ifdef TCP_FASTOPEN_CONNECT
+Set fast_open_index; /* hash of an address -> index into `fast_opens` */
+const char **fast_opens; /* addresses which won a race, the kernel might have a TCP Fast Open cookie for them */
+int fast_open_count, fast_open_capacity;
+#endif /* TCP_FASTOPEN_CONNECT */
+Set interned; /* hash -> index into `strings` */
+const char **strings;
+int string_count, string_capacity;
+Arena *string_arena; /* owns the interned strings until we quit */
+Cache *cache = NULL;
+DiskEntry *disk_cache = NULL;
+Host *hosts = NULL;
+Transfer *transfers = NULL;
+Queue prefetch;
+Transfer *loading = NULL; /* a menu which is still loading in the background */
+Navigation *arrived = NULL; /* loaded in the background while the shell was busy */
+volatile sig_atomic_t interrupted = 0;
+char prompt[256];
+int at_prompt = 0;
+Buffer screen = { NULL, 0, 0, 0 }; /* output of the pager, written once per page */
+volatile sig_atomic_t resized = 1;
+int terminal_height = 0;
+
+/* escape sequences for the output, so they don't have to be formatted over and over again */
+static const char *esc_reset = "\33[0m";
+static const char *esc_info = "\33[34m";
+static const char *esc_error = "\33[31m";
+static const char *esc_link = "\33[4;36m";
+static const char *esc_item = "\33[0;36m";
+static const char *esc_pager = "\33[0;32m";
+static const char *esc_prompt = "\33[35m";
+static const char *esc_clear = "\r\33[K";
+int batch = 0; /* no prompt, pager or colors, messages go to stderr, see run_batch() */
+int disk_cache_loaded = 0;
+int disk_cache_dirty = 0;
+int disk_cache_puts = 0; /* since the index was saved, see disk_cache_put() */
+Index search; /* full-text index of everything we have visited, see find_documents() */
 
 
 /*============================================================================*/
 void vlogf(const char *color, const char *fmt, va_list va) {
-	printf("\33[%sm", color);
-	vprintf(fmt, va);
-	puts("\33[0m");
+	char buffer[2048];
+	size_t length, reset = strlen(esc_reset) + 1;
+
+	/* one stdio call per message, so it leaves in one piece */
+	length = snprintf(buffer, sizeof(buffer), "%s", color);
+	length += vsnprintf(buffer + length, sizeof(buffer) - length - reset, fmt, va);
+	if (length > sizeof(buffer) - reset - 1) length = sizeof(buffer) - reset - 1;
+	snprintf(buffer + length, sizeof(buffer) - length, "%s\n", esc_reset);
+	fputs(buffer, batch ? stderr : stdout);
 }
 
 void info(const char *fmt, ...) {
 	va_list va;
 	va_start(va, fmt);
-	vlogf("34", fmt, va);
+	vlogf(esc_info, fmt, va);
 	va_end(va);
 }
 
 void error(const char *fmt, ...) {
 	va_list va;
 	va_start(va, fmt);
-	vlogf("31", fmt, va);
+	vlogf(esc_error, fmt, va);
 	va_end(va);
 }
 
 void panic(const char *fmt, ...) {
 	va_list va;
 	va_start(va, fmt);
-	vlogf("31", fmt, va);
+	vlogf(esc_error, fmt, va);
 	va_end(va);
 	exit(EXIT_FAILURE);
 }
@@ -127,37 +466,159 @@ char *str_split(char **str, const char *delim) {
 	return begin;
 }
 
-int str_contains(const char *haystack, const char *needle) {
-	const char *a, *b;
-	for (; *haystack; ++haystack) {
-		for (a = haystack, b = needle; *a && *b; ++a, ++b) {
-			if (tolower(*a) != tolower(*b)) break;
-		}
-		if (*b == '\0') return 1;
+void init_fold() {
+	int i;
+	for (i = 0; i < 256; ++i) fold[i] = tolower(i);
+}
+
+
+char *str_lower(char *buffer, size_t size, const char *str) {
+	size_t i;
+	for (i = 0; str[i] && i < size - 1; ++i) buffer[i] = fold[(unsigned char)str[i]];
+	buffer[i] = '\0';
+	return buffer;
+}
+
+
+/* `needle` has to be lower case already */
+int str_contains_lower(const char *haystack, const char *needle, size_t length) {
+	const unsigned char *h = (const unsigned char*)haystack, *n = (const unsigned char*)needle;
+	size_t i;
+
+	if (length == 0) return 1;
+	for (; *h; ++h) {
+		/* check the first two bytes before comparing the rest, a NUL never matches */
+		if (fold[h[0]] != n[0] || (length > 1 && fold[h[1]] != n[1])) continue;
+		for (i = 2; i < length && fold[h[i]] == n[i]; ++i) ;
+		if (i >= length) return 1;
 	}
 	return 0;
 }
 
 
+int str_contains(const char *haystack, const char *needle) {
+	char lower[256];
+	str_lower(lower, sizeof(lower), needle);
+	return str_contains_lower(haystack, lower, strlen(lower));
+}
+
+
+unsigned long long hash_bytes(const char *data, size_t length) {
+	unsigned long long hash = 14695981039346656037ULL; /* FNV-1a */
+	for (; length > 0; ++data, --length) hash = (hash ^ (unsigned char)*data) * 1099511628211ULL;
+	return hash;
+}
+
+
+unsigned long long hash_string(const char *str) {
+	return hash_bytes(str, strlen(str));
+}
+
+
+/*============================================================================*/
+void free_set(Set *set) {
+	free(set->slots);
+	free(set->values);
+	memset(set, 0, sizeof(Set));
+}
+
+
+int *set_lookup(Set *set, unsigned long long hash) {
+	size_t i;
+
+	if (set->size == 0) return NULL;
+	if (hash == 0) hash = 1; /* 0 is the free slot */
+	for (i = hash & (set->size - 1); set->slots[i]; i = (i + 1) & (set->size - 1)) {
+		if (set->slots[i] == hash) return &set->values[i];
+	}
+	return NULL;
+}
+
+
+/* returns 0 when `hash` is already a member */
+int set_insert(Set *set, unsigned long long hash, int value) {
+	size_t i;
+
+	if (hash == 0) hash = 1;
+	if (set->count * 2 >= set->size) { /* keep it at most half full, so the probes stay short */
+		Set grown;
+		grown.size = set->size ? set->size * 2 : 1024;
+		grown.count = 0;
+		grown.slots = calloc(grown.size, sizeof(unsigned long long));
+		grown.values = calloc(grown.size, sizeof(int));
+		if (grown.slots == NULL || grown.values == NULL) panic("cannot allocate set");
+		for (i = 0; i < set->size; ++i) if (set->slots[i]) set_insert(&grown, set->slots[i], set->values[i]);
+		free(set->slots);
+		free(set->values);
+		*set = grown;
+	}
+	for (i = hash & (set->size - 1); set->slots[i]; i = (i + 1) & (set->size - 1)) {
+		if (set->slots[i] == hash) return 0;
+	}
+	set->slots[i] = hash;
+	set->values[i] = value;
+	++set->count;
+	return 1;
+}
+
+
+/*============================================================================*/
+long long now_us() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+
 /*============================================================================*/
-void free_variable(Variable *var) {
+void free_script(Script *script) {
+	int i;
+	if (script == NULL) return;
+	if (script->running) { script->stale = 1; return; }
+	for (i = 0; i < script->count; ++i) {
+		str_free(script->statements[i].name);
+		str_free(script->statements[i].args);
+	}
+	free(script->statements);
+	free(script);
+}
+
+
+void free_variable(Table *table) {
+	Variable *var = table->list;
 	while (var) {
 		Variable *next = var->next;
 		str_free(var->name);
 		str_free(var->data);
+		free_script(var->script);
 		free(var);
 		var = next;
 	}
+	memset(table, 0, sizeof(Table));
 }
 
 
-char *set_var(Variable **list, const char *name, const char *fmt, ...) {
-	Variable *var;
+Variable **find_bucket(Table *table, const char *name) {
+	unsigned int hash = 2166136261U; /* FNV-1a over the lower case name */
+	for (; *name; ++name) hash = (hash ^ (unsigned char)tolower(*name)) * 16777619U;
+	return &table->buckets[hash % (sizeof(table->buckets) / sizeof(table->buckets[0]))];
+}
 
-	if (name == NULL) return NULL;
-	for (var = *list; var; var = var->next) {
+
+Variable *find_var(Table *table, const char *name) {
+	Variable *var;
+	for (var = *find_bucket(table, name); var; var = var->chain) {
 		if (!strcasecmp(var->name, name)) break;
 	}
+	return var;
+}
+
+
+char *set_var(Table *table, const char *name, const char *fmt, ...) {
+	Variable *var;
+
+	if (name == NULL) return NULL;
+	var = find_var(table, name);
 
 	if (fmt) {
 		va_list va;
@@ -168,15 +629,22 @@ char *set_var(Variable **list, const char *name, const char *fmt, ...) {
 		va_end(va);
 
 		if (var == NULL) {
+			Variable **bucket = find_bucket(table, name);
 			if ((var = malloc(sizeof(Variable))) == NULL) panic("cannot allocate new variable");
-			var->next = *list;
+			var->next = table->list;
+			var->chain = *bucket;
 			var->name = str_copy((char*)name);
-			var->data = str_copy(buffer);
-			*list = var;
+			var->script = NULL;
+			table->list = *bucket = var;
 		} else {
 			str_free(var->data);
-			var->data = str_copy(buffer);
+			free_script(var->script); /* an alias has to be compiled again */
+			var->script = NULL;
 		}
+		var->data = str_copy(buffer);
+		var->is_integer = sscanf(buffer, "%d", &var->integer) == 1;
+		var->boolean = !strcasecmp(buffer, "on") || !strcasecmp(buffer, "true");
+		++table->generation;
 	}
 
 	return var ? var->data : NULL;
@@ -184,82 +652,223 @@ char *set_var(Variable **list, const char *name, const char *fmt, ...) {
 
 
 int get_var_boolean(const char *name) {
-	char *data = set_var(&variables, name, NULL);
-	return data ? (!strcasecmp(data, "on") || !strcasecmp(data, "true")) : 0;
+	Variable *var = find_var(&variables, name);
+	return var ? var->boolean : 0;
 }
 
 
 int get_var_integer(const char *name, int def) {
-	int value;
-	char *data = set_var(&variables, name, NULL);
-	if (data == NULL || sscanf(data, "%d", &value) != 1) return def;
-	return value;
+	Variable *var = find_var(&variables, name);
+	return var && var->is_integer ? var->integer : def;
 }
 
 
 /*============================================================================*/
-Selector *new_selector() {
-	Selector *new = malloc(sizeof(Selector));
-	if (new == NULL) panic("cannot allocate new selector");
-	new->next = NULL;
-	new->index = 0;
-	return new;
+void *arena_alloc(Arena **arena, size_t size) {
+	Arena *block = *arena;
+	void *p;
+
+	size = (size + sizeof(void*) - 1) & ~(sizeof(void*) - 1); /* keep everything pointer aligned */
+	if (block == NULL || block->used + size > block->size) {
+		size_t capacity = block ? block->size * 2 : 1024 * 16;
+		if (capacity > 1024 * 1024) capacity = 1024 * 1024;
+		if (capacity < size) capacity = size;
+		if ((block = malloc(sizeof(Arena) + capacity)) == NULL) panic("cannot allocate new arena block");
+		block->next = *arena;
+		block->used = 0;
+		block->size = capacity;
+		*arena = block;
+	}
+	p = &block->data[block->used];
+	block->used += size;
+	return p;
 }
 
-void free_selector(Selector *sel) {
-	while (sel) {
-		Selector *next = sel->next;
-		str_free(sel->name);
-		str_free(sel->host);
-		str_free(sel->port);
-		str_free(sel->path);
-		free(sel);
-		sel = next;
+
+char *arena_copy(Arena **arena, const char *str) {
+	size_t length = strlen(str) + 1;
+	return memcpy(arena_alloc(arena, length), str, length);
+}
+
+
+void free_arena(Arena *arena) {
+	while (arena) {
+		Arena *next = arena->next;
+		free(arena);
+		arena = next;
+	}
+}
+
+
+/*============================================================================*/
+/* returns the one copy of a string, equal strings are the same pointer */
+const char *intern(const char *str, size_t length) {
+	unsigned long long hash = hash_bytes(str, length);
+	int *id = set_lookup(&interned, hash);
+	char *copy;
+
+	if (id && !strncmp(strings[*id], str, length) && strings[*id][length] == '\0') return strings[*id];
+	copy = memcpy(arena_alloc(&string_arena, length + 1), str, length);
+	copy[length] = '\0';
+	if (id) return copy; /* a hash collision, this one just doesn't get shared */
+	if (string_count == string_capacity) {
+		string_capacity = string_capacity ? string_capacity * 2 : 256;
+		if ((strings = realloc(strings, string_capacity * sizeof(char*))) == NULL) panic("cannot allocate strings");
 	}
+	set_insert(&interned, hash, string_count);
+	strings[string_count++] = copy;
+	return copy;
+}
+
+
+const char *intern_string(const char *str) {
+	if (str == NULL) str = "";
+	return intern(str, strlen(str));
+}
+
+
+void free_strings() {
+	free_set(&interned);
+	free(strings);
+	free_arena(string_arena);
+	strings = NULL;
+	string_count = string_capacity = 0;
+	string_arena = NULL;
+}
+
+
+/*============================================================================*/
+void init_selector_list(SelectorList *list, int reverse) {
+	list->items = NULL;
+	list->count = list->capacity = 0;
+	list->reverse = reverse;
+	list->arena = NULL;
+	list->generation = ++list_generation;
+}
+
+
+void free_selector(Selector *sel) {
+	str_free(sel->name);
+	str_free(sel->path);
 }
 
 
-Selector *copy_selector(Selector *sel) {
-	Selector *new = new_selector();
-	new->next = NULL;
+void free_selector_list(SelectorList *list) {
+	int i;
+	if (list->arena == NULL) for (i = 0; i < list->count; ++i) free_selector(&list->items[i]);
+	free_arena(list->arena);
+	free(list->items);
+	init_selector_list(list, list->reverse);
+}
+
+
+void copy_selector(Selector *new, const Selector *sel) {
 	new->index = 1;
 	new->type = sel->type;
 	new->name = str_copy(sel->name);
-	new->host = str_copy(sel->host);
-	new->port = str_copy(sel->port);
+	new->host = intern_string(sel->host);
+	new->port = intern_string(sel->port);
 	new->path = str_copy(sel->path);
-	return new;
 }
 
 
-Selector *append_selector(Selector *list, Selector *sel) {
-	if (list == NULL) {
-		sel->next = NULL;
-		sel->index = 1;
-		return sel;
-	} else {
-		Selector *it;
-		for (it = list; it->next; it = it->next) ;
-		it->next = sel;
-		sel->next = NULL;
-		sel->index = it->index + 1;
-		return list;
+Selector *append_selector(SelectorList *list, const Selector *sel) {
+	Selector copy = *sel; /* `sel` might point into the list itself */
+	if (list->count == list->capacity) {
+		list->capacity = list->capacity ? list->capacity * 2 : 64;
+		if ((list->items = realloc(list->items, list->capacity * sizeof(Selector))) == NULL) panic("cannot allocate selector list");
 	}
+	copy.index = list->count + 1;
+	list->items[list->count] = copy;
+	list->generation = ++list_generation;
+	return &list->items[list->count++];
 }
 
 
-Selector *prepend_selector(Selector *list, Selector *sel) {
-	sel->next = list;
-	sel->index = list ? list->index + 1 : 1;
-	return sel;
+void copy_selector_list(SelectorList *new, const SelectorList *list) {
+	Selector sel;
+	int i;
+
+	init_selector_list(new, list->reverse);
+	for (i = 0; i < list->count; ++i) {
+		sel.type = list->items[i].type;
+		sel.name = arena_copy(&new->arena, list->items[i].name);
+		sel.host = list->items[i].host;
+		sel.port = list->items[i].port;
+		sel.path = arena_copy(&new->arena, list->items[i].path);
+		append_selector(new, &sel);
+	}
 }
 
 
-Selector *find_selector(Selector *list, const char *line) {
-	int index;
-	if ((index = atoi(line)) <= 0) return NULL;
-	for (; list; list = list->next) if (list->index == index) return list;
-	return NULL;
+Selector *last_selector(SelectorList *list) {
+	return list->count ? &list->items[list->count - 1] : NULL;
+}
+
+
+Selector *find_selector(SelectorList *list, const char *line) {
+	int index = atoi(line);
+	return index > 0 && index <= list->count ? &list->items[index - 1] : NULL;
+}
+
+
+/*============================================================================*/
+unsigned long long history_hash(const Selector *sel) {
+	char buffer[2048];
+	int length = snprintf(buffer, sizeof(buffer), "%c%s\t%s\t%s", sel->type, sel->host, sel->port, sel->path);
+	return hash_bytes(buffer, length > 0 && (size_t)length < sizeof(buffer) ? (size_t)length : sizeof(buffer) - 1);
+}
+
+
+/* the index of the entry stamped `stamp` or -1 when it left the history */
+int find_stamp(int stamp) {
+	int low = 0, high = history.count - 1, mid;
+	while (low <= high) {
+		mid = (low + high) / 2;
+		if (history_stamps[mid] == stamp) return mid;
+		if (history_stamps[mid] < stamp) low = mid + 1;
+		else high = mid - 1;
+	}
+	return -1;
+}
+
+
+void remove_history_entry(int i) {
+	free_selector(&history.items[i]);
+	--history.count;
+	memmove(&history.items[i], &history.items[i + 1], (history.count - i) * sizeof(Selector));
+	memmove(&history_stamps[i], &history_stamps[i + 1], (history.count - i) * sizeof(int));
+	for (; i < history.count; ++i) history.items[i].index = i + 1;
+	history.generation = ++list_generation;
+}
+
+
+/* takes over `sel` like append_selector(), a revisit moves the entry to the end and the oldest go beyond HISTORY_SIZE */
+Selector *visit_selector(const Selector *sel) {
+	unsigned long long hash = history_hash(sel);
+	int *slot = set_lookup(&history_index, hash), i = -1, limit = get_var_integer("HISTORY_SIZE", 1000);
+
+	if (slot && (i = find_stamp(*slot)) != -1 && history.items[i].type == sel->type && history.items[i].host == sel->host &&
+		history.items[i].port == sel->port && !strcmp(history.items[i].path, sel->path)) {
+		remove_history_entry(i);
+		i = -1;
+	}
+	while (history.count > 0 && history.count >= limit) remove_history_entry(0);
+	if (history.count == history.capacity) {
+		if ((history_stamps = realloc(history_stamps, (history.capacity ? history.capacity * 2 : 64) * sizeof(int))) == NULL) panic("cannot allocate history");
+	}
+	append_selector(&history, sel);
+	history_stamps[history.count - 1] = ++history_stamp;
+
+	if (history_index.count > (size_t)history.count * 2 + 1024) { /* most slots belong to entries which are gone */
+		free_set(&history_index);
+		for (i = 0; i < history.count; ++i) set_insert(&history_index, history_hash(&history.items[i]), history_stamps[i]);
+	} else if ((slot = set_lookup(&history_index, hash)) == NULL) {
+		set_insert(&history_index, hash, history_stamp);
+	} else if (i == -1 || find_stamp(*slot) == -1) {
+		*slot = history_stamp; /* unless a different entry with the same hash is still there */
+	}
+	return last_selector(&history);
 }
 
 
@@ -274,29 +883,28 @@ char *print_selector(Selector *sel, int with_prefix) {
 }
 
 
-Selector *parse_selector(char *str) {
+Selector *parse_selector(Selector *sel, char *str) {
 	char *p;
-	Selector *sel;
 
 	if (str == NULL || *str == '\0') return NULL;
 
-	sel = new_selector();
+	sel->index = 1;
 	sel->type = '1';
 
 	if ((p = strstr(str, "gopher://")) == str) str += 9; /* skip "gopher://" */
 	if ((p = strpbrk(str, ":/")) != NULL) {
 		if (*p == ':') {
-			sel->host = str_copy(str_split(&str, ":"));
-			sel->port = str_copy(str_split(&str, "/"));
+			sel->host = intern_string(str_split(&str, ":"));
+			sel->port = intern_string(str_split(&str, "/"));
 		} else {
-			sel->host = str_copy(str_split(&str, "/"));
-			sel->port = str_copy("70");
+			sel->host = intern_string(str_split(&str, "/"));
+			sel->port = intern_string("70");
 		}
 		if (*str) sel->type = *str++;
 		sel->path = str_copy(str);
 	} else {
-		sel->host = str_copy(str);
-		sel->port = str_copy("70");
+		sel->host = intern_string(str);
+		sel->port = intern_string("70");
 		sel->path = str_copy("");
 	}
 
@@ -306,26 +914,63 @@ Selector *parse_selector(char *str) {
 }
 
 
-Selector *parse_selector_list(char *str) {
-	char *line;
-	Selector *list = NULL, *sel;
+char *next_field(char **line) {
+	char *field = str_split(line, "\t");
+	return field ? field : "";
+}
 
-	while ((line = str_split(&str, "\r\n")) != NULL) {
-		if (*line == '\0' || *line == '.') break;
 
-		sel = new_selector();
-		list = append_selector(list, sel);
+void parse_selector_chunk(Parser *parser, const char *data, size_t length, int eof) {
+	const char *line, *end, *cr, *host, *port, *stop;
+	long long started = now_us();
+	size_t offset = parser->offset;
+	Selector sel;
+	char *str;
+
+	/* only complete lines are parsed, a partial one waits for the next chunk or the end of the data */
+	while (!parser->ended && parser->offset < length) {
+		line = data + parser->offset;
+		if ((end = memchr(line, '\n', length - parser->offset)) != NULL) parser->offset = end - data + 1;
+		else if (eof) parser->offset = length, end = data + length;
+		else break;
+
+		if ((cr = memchr(line, '\r', end - line)) != NULL) end = cr;
+		if (line == end) continue;
+		if (*line == '.') { parser->ended = 1; break; }
+
+		/* host and port are shared with all other selectors, only name and path are copied into the arena */
+		if ((host = memchr(line, '\t', end - line)) != NULL) host = memchr(host + 1, '\t', end - host - 1);
+		host = host ? host + 1 : end;
+		if ((port = memchr(host, '\t', end - host)) == NULL) port = end;
+		sel.host = intern(host, port - host);
+		if (port < end) ++port;
+		if ((stop = memchr(port, '\t', end - port)) == NULL) stop = end;
+		sel.port = intern(port, stop - port);
+
+		str = memcpy(arena_alloc(&parser->list->arena, (host - line) + 1), line, host - line);
+		str[host - line] = '\0';
+		sel.type = *str++;
+		sel.name = next_field(&str);
+		sel.path = next_field(&str);
+		append_selector(parser->list, &sel);
+	}
+	stats.parsed += parser->offset - offset;
+	stats.parse_time += now_us() - started;
+}
 
-		sel->type = *line++;
-		sel->name = str_copy(str_split(&line, "\t"));
-		sel->path = str_copy(str_split(&line, "\t"));
-		sel->host = str_copy(str_split(&line, "\t"));
-		sel->port = str_copy(str_split(&line, "\t"));
 
-		str = str_skip(str, "\r\n");
-	}
+void init_parser(Parser *parser, SelectorList *list) {
+	init_selector_list(list, 0);
+	parser->list = list;
+	parser->offset = 0;
+	parser->ended = 0;
+}
+
 
-	return list;
+void parse_selector_list(SelectorList *list, const char *data, size_t length) {
+	Parser parser;
+	init_parser(&parser, list);
+	parse_selector_chunk(&parser, data, length, 1);
 }
 
 
@@ -337,227 +982,2873 @@ char *next_token(char **str) {
 		case '\0': case '#': return NULL;
 		case '"': ++*str; return str_split(str, "\"");
 		case '$': {
+			static char values[4][1024]; /* commands may modify their tokens, but not the variables */
+			static int next = 0;
 			char *data;
 			++*str;
-			data = set_var(&variables, str_split(str, " \v\t"), NULL);
-			return data ? data : "";
+			if ((data = set_var(&variables, str_split(str, " \v\t"), NULL)) == NULL) return "";
+			next = (next + 1) % 4;
+			snprintf(values[next], sizeof(values[next]), "%s", data);
+			return values[next];
 		}
 		default: return str_split(str, " \v\t");
 	}
 }
 
 
-char *read_line(const char *fmt, ...) {
-	static char buffer[256];
-	char *line;
-	if (fmt != NULL) {
-		va_list va;
-		va_start(va, fmt);
-		vprintf(fmt, va);
-		va_end(va);
-		fflush(stdout);
-	}
-	memset(buffer, 0, sizeof(buffer));
-	if ((line = fgets(buffer, sizeof(buffer), stdin)) == NULL) return NULL;
-	line = str_skip(line, " \v\t");
-	line = str_split(&line, "\r\n");
-	return line ? line : "";
+void resize(int sig) {
+	(void)sig;
+	resized = 1;
 }
 
 
 int get_terminal_height() {
 	struct winsize wz;
-	ioctl(STDOUT_FILENO, TIOCGWINSZ, &wz);
-	return wz.ws_row - 2; /* substract 2 lines (1 for tmux etc., 1 for the prompt) */
-}
 
+	/* only ask the terminal again after it told us it has been resized */
+	if (resized) {
+		resized = 0;
+		if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &wz) == -1 || wz.ws_row == 0) wz.ws_row = 24;
+		terminal_height = wz.ws_row - 2; /* substract 2 lines (1 for tmux etc., 1 for the prompt) */
+	}
+	return terminal_height;
+}
 
-int show_pager_stop() {
-	char buffer[256], *line;
 
-	printf("\33[0;32m-- press RETURN to continue (or 'q' and return to quit) --\33[0m");
-	fflush(stdout);
-	if ((line = fgets(buffer, sizeof(buffer), stdin)) == NULL) return 1;
-	line = str_skip(line, " \t\v");
-	return line[0] == 'q' || line[0] == 'Q';
+const char *make_prompt() {
+	snprintf(prompt, sizeof(prompt), "(%s%.200s%s)> ", esc_prompt, print_selector(last_selector(&history), 0), esc_reset);
+	return prompt;
 }
 
 
-void print_text(const char *text) {
-	char *copy, *str, *line, *p;
-	int i, pages, height, length;
-
-	height = get_terminal_height();
-	pages = get_var_boolean("PAGE_TEXT");
-	length = get_var_integer("LINE_LENGTH", 128);
+/* log something that happened in the background, probably while the prompt is shown */
+void notify(const char *color, const char *fmt, ...) {
+	va_list va;
 
-	copy = str = str_copy(text);
-	for (i = 0; (line = str_split(&str, "\n")) != NULL; ++i) {
-		for (p = line; *p; ++p) if (*p == '\r') *p = '\0'; /* remove any CR */
-		printf("%.*s\n", length, line);
-		if (pages && i >= height) { if (show_pager_stop()) break; i = 0; }
-		str = str_skip(str, "\r"); /* just skip CR so we can show empty lines */
+	if (at_prompt) fputs(esc_clear, stdout);
+	va_start(va, fmt);
+	vlogf(color, fmt, va);
+	va_end(va);
+	if (at_prompt) {
+#ifdef DELVE_USE_READLINE
+		rl_set_prompt(make_prompt());
+		rl_on_new_line();
+		rl_redisplay();
+#else
+		printf("%s", make_prompt());
+		fflush(stdout);
+#endif /* DELVE_USE_READLINE */
 	}
-	str_free(copy);
+}
+
+
+void interrupt(int sig) {
+	(void)sig;
+	interrupted = 1;
 }
 
 
 /*============================================================================*/
-char *download(Selector *sel, const char *query, size_t *length) {
-	struct addrinfo hints, *result, *it;
-	char request[1024], *data;
-	size_t total;
-	int fd, received;
+const char *cache_key(char *buffer, size_t size, Selector *sel, const char *query) {
+	snprintf(buffer, size, "%s:%s/%c%s\t%s",
+		sel->host, sel->port, sel->type, sel->path, query ? query : ""
+	);
+	return buffer;
+}
 
-	memset(&hints, 0, sizeof(hints));
-	hints.ai_family = AF_UNSPEC;
-	hints.ai_socktype = SOCK_STREAM;
-	hints.ai_protocol = IPPROTO_TCP;
 
-	if (getaddrinfo(sel->host, sel->port, &hints, &result) || result == NULL) {
-		error("cannot resolve hostname `%s`", sel->host);
-		goto fail;
+size_t selector_size(SelectorList *list) {
+	size_t size;
+	int i;
+	for (size = 0, i = 0; i < list->count; ++i) {
+		Selector *sel = &list->items[i];
+		size += sizeof(Selector) + strlen(sel->name) + strlen(sel->path) + 2; /* host and port are shared */
 	}
+	return size;
+}
+
 
-	for (it = result; it; it = it->ai_next) {
-		if ((fd = socket(it->ai_family, it->ai_socktype, it->ai_protocol)) == -1) continue;
-		if (connect(fd, it->ai_addr, it->ai_addrlen) == 0) break;
-		close(fd); fd = -1;
+void free_cache(Cache *entry) {
+	while (entry) {
+		Cache *next = entry->next;
+		str_free(entry->key);
+		free_selector_list(&entry->list);
+		free(entry);
+		entry = next;
 	}
+}
 
-	freeaddrinfo(result);
 
-	if (fd == -1) {
-		error("cannot connect to `%s`:`%s`", sel->host, sel->port);
-		goto fail;
+Cache *unlink_cache(const char *key) {
+	Cache **it, *entry;
+	for (it = &cache; *it; it = &(*it)->next) {
+		if (!strcmp((*it)->key, key)) {
+			entry = *it;
+			*it = entry->next;
+			entry->next = NULL;
+			return entry;
+		}
 	}
+	return NULL;
+}
+
+
+/* search results have their own TTL, only their keys carry a query */
+int cache_ttl(const char *key, const char *name, int def) {
+	const char *query = strchr(key, '\t');
+	return query && query[1] ? get_var_integer("SEARCH_TTL", 3600) : get_var_integer(name, def);
+}
+
 
-	if (query) snprintf(request, sizeof(request), "%s\t%s\r\n", sel->path, query);
-	else snprintf(request, sizeof(request), "%s\r\n", sel->path);
-	send(fd, request, strlen(request), 0);
+int cache_get(const char *key, SelectorList *list, int stale) {
+	Cache *entry;
+	int ttl = cache_ttl(key, "CACHE_TTL", 300);
 
-	for (total = 0L, data = NULL;;) {
-		if ((data = realloc(data, total + (1024 * 64))) == NULL) panic("cannot allocate download data");
-		if ((received = recv(fd, &data[total], 1024 * 64, 0)) <= 0) break;
-		total += received;
-		if (total > (1024 * 256)) printf("downloading %.2f kb...\r", (double)total / 1024.0);
+	if ((entry = unlink_cache(key)) == NULL) { ++stats.cache_misses; return 0; }
+	if (!stale && ttl >= 0 && time(NULL) - entry->stamp > ttl) {
+		free_cache(entry);
+		++stats.cache_misses;
+		return 0;
 	}
-	if (total > (1024 * 256)) puts("");
+	entry->next = cache; /* move to the front, it is the most recently used now */
+	cache = entry;
+	copy_selector_list(list, &entry->list);
+	++stats.cache_hits;
+	return 1;
+}
 
-	close(fd);
-	data = realloc(data, total + 1);
-	data[total] = '\0';
 
-	if (length) *length = total;
-	return data;
+int cache_fresh(const char *key) {
+	Cache *entry;
+	int ttl = cache_ttl(key, "CACHE_TTL", 300);
 
-fail:
-	if (length) *length = 0L;
-	return NULL;
+	for (entry = cache; entry; entry = entry->next) {
+		if (!strcmp(entry->key, key)) return ttl < 0 || time(NULL) - entry->stamp <= ttl;
+	}
+	return 0;
 }
 
 
-char *download_to_temp(Selector *sel) {
-	static char filename[1024];
-	size_t length;
-	char *data, *tmpdir, template[1024];
-	int fd;
+void cache_put(const char *key, SelectorList *list) {
+	Cache **it, *entry;
+	size_t total, limit = (size_t)get_var_integer("CACHE_SIZE", 4096) * 1024;
 
-	if ((data = download(sel, NULL, &length)) == NULL) return NULL;
-	if ((tmpdir = getenv("TMPDIR")) == NULL) tmpdir = "/tmp/";
-	snprintf(template, sizeof(template), "%sdelve.XXXXXXXX", tmpdir);
-	snprintf(filename, sizeof(filename), "%s", template);
-	if ((fd = mkstemp(filename)) == -1) {
-		error("cannot create temporary file: %s", strerror(errno));
-		goto fail;
+	free_cache(unlink_cache(key));
+	if (list->count == 0 || selector_size(list) > limit) return;
+
+	if ((entry = malloc(sizeof(Cache))) == NULL) panic("cannot allocate new cache entry");
+	entry->key = str_copy(key);
+	copy_selector_list(&entry->list, list);
+	entry->size = selector_size(list);
+	entry->stamp = time(NULL);
+	entry->next = cache;
+	cache = entry;
+
+	/* drop the least recently used entries until we fit into the limit */
+	for (total = 0, it = &cache; *it; it = &(*it)->next) {
+		if ((total += (*it)->size) > limit) break;
 	}
-	if (write(fd, data, length) != (int)length) {
-		error("cannot write data to temporary file: %s", strerror(errno));
-		goto fail;
+	free_cache(*it);
+	*it = NULL;
+}
+
+
+/*============================================================================*/
+const char *cache_directory() {
+	static char buffer[1024];
+	char *dir;
+
+	if ((dir = set_var(&variables, "CACHE_DIRECTORY", NULL)) != NULL) return dir;
+	if ((dir = getenv("XDG_CACHE_HOME")) != NULL && *dir) snprintf(buffer, sizeof(buffer), "%s/delve", dir);
+	else if ((dir = getenv("HOME")) != NULL) snprintf(buffer, sizeof(buffer), "%s/.cache/delve", dir);
+	else return "";
+	return buffer;
+}
+
+
+const char *cache_file(const char *key) {
+	static char buffer[1024];
+	snprintf(buffer, sizeof(buffer), "%s/%016llx", cache_directory(), hash_string(key));
+	return buffer;
+}
+
+
+int make_directory(const char *path, int mode) {
+	char buffer[1024], *p;
+
+	snprintf(buffer, sizeof(buffer), "%s", path);
+	for (p = buffer + 1; *p; ++p) {
+		if (*p == '/') { *p = '\0'; mkdir(buffer, mode); *p = '/'; }
 	}
-	close(fd);
-	free(data);
-	return filename;
+	return mkdir(buffer, mode) == 0 || errno == EEXIST;
+}
 
-fail:
-	if (data) free(data);
-	if (fd) {
-		close(fd);
-		remove(filename);
+
+int write_all(int fd, const char *data, size_t length) {
+	ssize_t written;
+	for (; length > 0; data += written, length -= written) {
+		if ((written = write(fd, data, length)) <= 0) {
+			if (written == -1 && errno == EINTR) { written = 0; continue; }
+			return 0;
+		}
 	}
-	return NULL;
+	return 1;
 }
 
 
-void download_to_file(Selector *sel) {
-	char *filename, *def, *data, *download_dir, suggestion[1024];
-	size_t length;
-	FILE *fp;
+/* handlers started by us must not inherit our sockets, logs and files */
+int close_on_exec(int fd) {
+	if (fd != -1) fcntl(fd, F_SETFD, fcntl(fd, F_GETFD) | FD_CLOEXEC);
+	return fd;
+}
 
-	def = strrchr(sel->path, '/');
-	if (*def == '/') ++def;
-	if ((download_dir = set_var(&variables, "DOWNLOAD_DIRECTORY", NULL)) == NULL) download_dir = ".";
-	snprintf(suggestion, sizeof(suggestion), "%s/%s", download_dir, def);
 
-	if ((data = download(sel, NULL, &length)) == NULL) return;
-	if ((filename = read_line("enter filename (press ENTER for `%s`): ", suggestion)) == NULL) return;
-	if (!strlen(filename)) filename = suggestion;
-	if ((fp = fopen(filename, "wb")) == NULL) {
-		free(data);
-		error("cannot create file `%s`: %s", filename, strerror(errno));
-		return;
-	}
-	fwrite(data, 1, length, fp);
-	fclose(fp);
-	free(data);
+void init_buffer(Buffer *buf) {
+	buf->data = NULL;
+	buf->length = buf->size = 0;
+	buf->mapped = 0;
 }
 
 
-Selector *download_to_menu(Selector *sel, const char *query) {
-	char *data;
-	Selector *list;
+void free_buffer(Buffer *buf) {
+	if (buf->data == NULL) return;
+	if (buf->mapped) munmap(buf->data, buf->length + 1);
+	else free(buf->data);
+	init_buffer(buf);
+}
 
-	if ((data = download(sel, query, NULL)) == NULL) return NULL;
-	list = parse_selector_list(data);
-	free(data);
-	return list;
+
+char *reserve_buffer(Buffer *buf, size_t length) {
+	size_t size;
+
+	/* grow geometrically so large transfers don't copy the data over and over again */
+	if (buf->length + length < buf->size) return &buf->data[buf->length];
+	for (size = buf->size ? buf->size : 1024 * 64; size <= buf->length + length; size *= 2) ;
+	if ((buf->data = realloc(buf->data, size)) == NULL) panic("cannot allocate buffer");
+	buf->size = size;
+	return &buf->data[buf->length];
+}
+
+
+int disk_cache_enabled() {
+	return *cache_directory() && get_var_integer("DISK_CACHE_SIZE", 65536) > 0;
+}
+
+
+void free_disk_entry(DiskEntry *entry) {
+	while (entry) {
+		DiskEntry *next = entry->next;
+		str_free(entry->key);
+		free(entry);
+		entry = next;
+	}
+}
+
+
+DiskEntry *new_disk_entry(const char *key, size_t size, time_t stamp) {
+	DiskEntry *entry = malloc(sizeof(DiskEntry));
+	if (entry == NULL) panic("cannot allocate new disk cache entry");
+	entry->next = NULL;
+	entry->key = str_copy(key);
+	entry->size = size;
+	entry->stamp = stamp;
+	return entry;
+}
+
+
+DiskEntry *unlink_disk_entry(const char *key) {
+	DiskEntry **it, *entry;
+	for (it = &disk_cache; *it; it = &(*it)->next) {
+		if (!strcmp((*it)->key, key)) {
+			entry = *it;
+			*it = entry->next;
+			entry->next = NULL;
+			return entry;
+		}
+	}
+	return NULL;
+}
+
+
+void load_disk_cache() {
+	char filename[1024], line[2048], *key;
+	DiskEntry **tail = &disk_cache;
+	unsigned long size;
+	long stamp;
+	int offset;
+	FILE *fp;
+
+	disk_cache_loaded = 1;
+	snprintf(filename, sizeof(filename), "%s/index", cache_directory());
+	if ((fp = fopen(filename, "r")) == NULL) return;
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		if (sscanf(line, "%lu %ld %n", &size, &stamp, &offset) != 2) continue;
+		key = line + offset;
+		if ((key = str_split(&key, "\r\n")) == NULL) continue;
+		*tail = new_disk_entry(key, size, stamp);
+		tail = &(*tail)->next;
+	}
+	fclose(fp);
+}
+
+
+void save_disk_cache() {
+	char filename[1024], temp[1032];
+	DiskEntry *entry;
+	FILE *fp;
+
+	if (!disk_cache_dirty) return;
+	disk_cache_dirty = disk_cache_puts = 0;
+	snprintf(filename, sizeof(filename), "%s/index", cache_directory());
+	snprintf(temp, sizeof(temp), "%s.tmp", filename);
+	if ((fp = fopen(temp, "w")) == NULL) return;
+	for (entry = disk_cache; entry; entry = entry->next) {
+		fprintf(fp, "%lu %ld %s\n", (unsigned long)entry->size, (long)entry->stamp, entry->key);
+	}
+	if (fclose(fp) == 0) rename(temp, filename);
+	else remove(temp);
+}
+
+
+char *disk_cache_get(const char *key, Buffer *buf, int stale) {
+	DiskEntry *entry;
+	struct stat st;
+	int fd, ttl = cache_ttl(key, "DISK_CACHE_TTL", 86400);
+
+	if (!disk_cache_enabled()) return NULL;
+	if (!disk_cache_loaded) load_disk_cache();
+	if ((entry = unlink_disk_entry(key)) == NULL) { ++stats.disk_misses; return NULL; }
+
+	if ((fd = open(cache_file(key), O_RDONLY | O_CLOEXEC)) == -1 || fstat(fd, &st) || (size_t)st.st_size != entry->size + 1) {
+		if (fd != -1) close(fd);
+		free_disk_entry(entry);
+		disk_cache_dirty = 1;
+		++stats.disk_misses;
+		return NULL;
+	}
+
+	entry->next = disk_cache; /* move to the front, it is the most recently used now */
+	disk_cache = entry;
+	disk_cache_dirty = 1;
+
+	if (!stale && ttl >= 0 && time(NULL) - entry->stamp > ttl) {
+		close(fd);
+		++stats.disk_misses;
+		return NULL;
+	}
+
+	/* the file carries a trailing NUL, the private mapping may be modified by the parsers */
+	buf->data = mmap(NULL, entry->size + 1, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (buf->data == MAP_FAILED) {
+		buf->data = NULL;
+		return NULL;
+	}
+	buf->length = entry->size;
+	buf->mapped = 1;
+	++stats.disk_hits;
+	return buf->data;
+}
+
+
+int disk_cache_fresh(const char *key) {
+	DiskEntry *entry;
+	int ttl = cache_ttl(key, "DISK_CACHE_TTL", 86400);
+
+	if (!disk_cache_enabled()) return 0;
+	if (!disk_cache_loaded) load_disk_cache();
+	for (entry = disk_cache; entry; entry = entry->next) {
+		if (!strcmp(entry->key, key)) return ttl < 0 || time(NULL) - entry->stamp <= ttl;
+	}
+	return 0;
+}
+
+
+void disk_cache_put(const char *key, const char *data, size_t length) {
+	char filename[1024], temp[1032];
+	DiskEntry **it, *entry;
+	size_t total, limit = (size_t)get_var_integer("DISK_CACHE_SIZE", 65536) * 1024;
+	int fd;
+
+	if (!disk_cache_enabled() || length + 1 > limit) return;
+	if (!disk_cache_loaded) load_disk_cache();
+	if (!make_directory(cache_directory(), 0700)) return;
+
+	snprintf(filename, sizeof(filename), "%s", cache_file(key));
+	snprintf(temp, sizeof(temp), "%s.tmp", filename);
+	if ((fd = open(temp, O_WRONLY | O_CLOEXEC | O_CREAT | O_TRUNC, 0600)) == -1) return;
+	if (!write_all(fd, data, length) || !write_all(fd, "", 1)) {
+		close(fd);
+		remove(temp);
+		return;
+	}
+	close(fd);
+	if (rename(temp, filename)) { remove(temp); return; }
+
+	free_disk_entry(unlink_disk_entry(key));
+	entry = new_disk_entry(key, length, time(NULL));
+	entry->next = disk_cache;
+	disk_cache = entry;
+
+	/* drop the least recently used responses until we fit into the limit */
+	for (total = 0, it = &disk_cache; *it; it = &(*it)->next) {
+		if ((total += (*it)->size + 1) > limit) break;
+	}
+	for (entry = *it; entry; entry = entry->next) remove(cache_file(entry->key));
+	free_disk_entry(*it);
+	*it = NULL;
+
+	/* the index is saved when we quit, crawls would rewrite it for every response otherwise */
+	disk_cache_dirty = 1;
+	if (++disk_cache_puts >= 64) save_disk_cache();
+}
+
+
+/*============================================================================*/
+const char *index_file() {
+	static char buffer[1024];
+	snprintf(buffer, sizeof(buffer), "%s/search", cache_directory());
+	return buffer;
+}
+
+
+void free_index() {
+	int i;
+	for (i = 0; i < search.term_count; ++i) {
+		str_free(search.terms[i].word);
+		free(search.terms[i].postings);
+	}
+	free(search.terms);
+	free(search.flags);
+	free(search.touched);
+	free_selector_list(&search.docs);
+	free_set(&search.keys);
+	free_set(&search.words);
+	memset(&search, 0, sizeof(Index));
+}
+
+
+void put_varint(Term *term, unsigned long value) {
+	if (term->length + 10 > term->size) {
+		term->size = term->size ? term->size * 2 : 16;
+		if ((term->postings = realloc(term->postings, term->size)) == NULL) panic("cannot allocate postings");
+	}
+	for (; value >= 0x80; value >>= 7) term->postings[term->length++] = (value & 0x7f) | 0x80;
+	term->postings[term->length++] = value;
+}
+
+
+const unsigned char *get_varint(const unsigned char *p, const unsigned char *end, unsigned long *value) {
+	int shift;
+	for (*value = 0, shift = 0; p < end && shift < 64; shift += 7) {
+		*value |= (unsigned long)(*p & 0x7f) << shift;
+		if (!(*p++ & 0x80)) return p;
+	}
+	return NULL;
+}
+
+
+/* copies the next word of `*text` folded to lower case into `word`, returns 0 at the end */
+int next_word(const char **text, const char *end, char *word) {
+	const char *start;
+	size_t length;
+
+	while (*text < end) {
+		for (; *text < end && !isalnum((unsigned char)**text) && (unsigned char)**text < 0x80; ++*text) ;
+		/* bytes of UTF-8 sequences are part of the words */
+		for (start = *text; *text < end && (isalnum((unsigned char)**text) || (unsigned char)**text >= 0x80); ++*text) ;
+		if ((length = *text - start) < 2 || length > MAX_WORD) continue;
+		for (word[length] = '\0'; length-- > 0; ) word[length] = fold[(unsigned char)start[length]];
+		return 1;
+	}
+	return 0;
+}
+
+
+Term *find_term(const char *word, int create) {
+	unsigned long long hash = hash_string(word);
+	int i, *id = set_lookup(&search.words, hash);
+	Term *term;
+
+	if (id && !strcmp(search.terms[*id].word, word)) return &search.terms[*id];
+	if (id) { /* a hash collision, those words are searched one by one */
+		for (i = 0; i < search.term_count; ++i) if (!strcmp(search.terms[i].word, word)) return &search.terms[i];
+	}
+	if (!create) return NULL;
+	if (search.term_count == search.term_capacity) {
+		search.term_capacity = search.term_capacity ? search.term_capacity * 2 : 1024;
+		if ((search.terms = realloc(search.terms, search.term_capacity * sizeof(Term))) == NULL) panic("cannot allocate terms");
+	}
+	if (id == NULL) set_insert(&search.words, hash, search.term_count);
+	term = &search.terms[search.term_count++];
+	memset(term, 0, sizeof(Term));
+	term->word = str_copy(word);
+	term->last = -1;
+	return term;
+}
+
+
+void add_words(const char *text, size_t length) {
+	const char *end = text + length;
+	char word[MAX_WORD + 1];
+	Term *term;
+
+	while (next_word(&text, end, word)) {
+		term = find_term(word, 1);
+		if (term->pending++) continue;
+		if (search.touched_count == search.touched_capacity) {
+			search.touched_capacity = search.touched_capacity ? search.touched_capacity * 2 : 256;
+			if ((search.touched = realloc(search.touched, search.touched_capacity * sizeof(int))) == NULL) panic("cannot allocate terms");
+		}
+		search.touched[search.touched_count++] = term - search.terms;
+	}
+}
+
+
+/* the latest document of a cache key, or -1 */
+int find_doc(const char *key) {
+	char other[1024];
+	int i, *id = set_lookup(&search.keys, hash_string(key));
+
+	if (id == NULL) return -1;
+	if (!strcmp(cache_key(other, sizeof(other), &search.docs.items[*id], NULL), key)) return *id;
+	/* a hash collision, those documents are searched one by one */
+	for (i = search.docs.count - 1; i >= 0; --i) {
+		if (!strcmp(cache_key(other, sizeof(other), &search.docs.items[i], NULL), key)) return i;
+	}
+	return -1;
+}
+
+
+/* adds a new document with all words added since the last call */
+int add_doc(Selector *sel, char flag) {
+	char key[1024];
+	unsigned long long hash;
+	Selector copy;
+	Term *term;
+	int i, old, *id, doc = search.docs.count;
+
+	if (doc == search.flags_capacity) {
+		search.flags_capacity = search.flags_capacity ? search.flags_capacity * 2 : 1024;
+		if ((search.flags = realloc(search.flags, search.flags_capacity)) == NULL) panic("cannot allocate documents");
+	}
+	hash = hash_string(cache_key(key, sizeof(key), sel, NULL));
+	if ((old = find_doc(key)) != -1) search.flags[old] = DOC_REPLACED; /* the new document knows more about the selector */
+	if ((id = set_lookup(&search.keys, hash)) == NULL) set_insert(&search.keys, hash, doc);
+	else if (*id == old) *id = doc; /* a colliding key keeps the slot of the other one */
+	copy_selector(&copy, sel);
+	append_selector(&search.docs, &copy);
+	search.flags[doc] = flag;
+
+	/* documents are only ever appended, so the deltas are always positive */
+	for (i = 0; i < search.touched_count; ++i) {
+		term = &search.terms[search.touched[i]];
+		put_varint(term, doc - term->last);
+		put_varint(term, term->pending);
+		term->last = doc;
+		term->pending = 0;
+		++term->count;
+	}
+	search.touched_count = 0;
+	search.dirty = 1;
+	return doc;
+}
+
+
+int known_doc(Selector *sel, char flag) {
+	char key[1024];
+	int doc = find_doc(cache_key(key, sizeof(key), sel, NULL));
+	return doc != -1 && (flag == DOC_LINK || search.flags[doc] == flag);
+}
+
+
+/* copies the next line of the mapped index, so sscanf() can't run past the end */
+int next_index_line(char **p, char *end, char *line, size_t size) {
+	char *next = memchr(*p, '\n', end - *p);
+	if (next == NULL || (size_t)(next - *p) >= size) return 0;
+	memcpy(line, *p, next - *p);
+	line[next - *p] = '\0';
+	*p = next + 1;
+	return 1;
+}
+
+
+/* the next document of the postings at `*p`, -1 at the end and -2 if they don't fit the index */
+int next_posting(const unsigned char **p, const unsigned char *end, int doc, unsigned long *frequency) {
+	unsigned long delta;
+
+	if (*p >= end) return -1;
+	if ((*p = get_varint(*p, end, &delta)) == NULL || (*p = get_varint(*p, end, frequency)) == NULL) return -2;
+	/* documents are ascending and have to exist */
+	if (delta == 0 || delta > (unsigned long)(search.docs.count - 1 - doc)) return -2;
+	return doc + (int)delta;
+}
+
+
+int valid_postings(const Term *term) {
+	const unsigned char *p = term->postings, *end = p + term->length;
+	unsigned long frequency;
+	int doc = -1, next, n = 0;
+
+	while ((next = next_posting(&p, end, doc, &frequency)) >= 0) {
+		doc = next;
+		if (++n > term->count) return 0;
+	}
+	return next == -1 && n == term->count && doc == term->last;
+}
+
+
+void drop_index() {
+	error("search index `%s` is corrupt, starting a new one", index_file());
+	free_index();
+	search.loaded = 1;
+}
+
+
+int load_index() {
+	char *data, *p, *end, line[4096], *str, word[MAX_WORD + 1];
+	unsigned long size;
+	int docs, terms, last, count, i;
+	Selector sel;
+	Term *term;
+	struct stat st;
+	int fd;
+
+	if (!disk_cache_enabled()) return 0;
+	if (search.loaded) return 1;
+	search.loaded = 1;
+	if ((fd = open(index_file(), O_RDONLY | O_CLOEXEC)) == -1) return 1;
+	if (fstat(fd, &st) || st.st_size == 0 || (data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED) {
+		close(fd);
+		return 1;
+	}
+	close(fd);
+
+	p = data;
+	end = data + st.st_size;
+	if (!next_index_line(&p, end, line, sizeof(line)) || sscanf(line, "delve search index 1 %d", &docs) != 1) goto corrupt;
+	for (i = 0; i < docs; ++i) {
+		if (!next_index_line(&p, end, line, sizeof(line)) || strlen(line) < 2) goto corrupt;
+		str = line + 2;
+		sel.type = line[1];
+		sel.name = next_field(&str);
+		sel.path = next_field(&str);
+		sel.host = next_field(&str);
+		sel.port = next_field(&str);
+		add_doc(&sel, line[0]);
+	}
+	if (!next_index_line(&p, end, line, sizeof(line)) || sscanf(line, "%d", &terms) != 1) goto corrupt;
+	for (i = 0; i < terms; ++i) {
+		if (!next_index_line(&p, end, line, sizeof(line))) goto corrupt;
+		if (sscanf(line, "%32s %d %d %lu", word, &last, &count, &size) != 4) goto corrupt;
+		if ((unsigned long)(end - p) <= size || p[size] != '\n') goto corrupt;
+		term = find_term(word, 1);
+		if (term->postings) goto corrupt; /* the word came up before */
+		if ((term->postings = malloc(size + 16)) == NULL) panic("cannot allocate postings");
+		memcpy(term->postings, p, size);
+		term->length = size;
+		term->size = size + 16;
+		term->last = last;
+		term->count = count;
+		p += size + 1;
+		if (!valid_postings(term)) goto corrupt;
+	}
+	munmap(data, st.st_size);
+	search.dirty = 0;
+	return 1;
+
+corrupt:
+	munmap(data, st.st_size);
+	drop_index();
+	return 1;
+}
+
+
+void save_index() {
+	char temp[1032];
+	Selector *sel;
+	Term *term;
+	FILE *fp;
+	int i;
+
+	if (!search.dirty || !make_directory(cache_directory(), 0700)) return;
+	search.dirty = 0;
+	snprintf(temp, sizeof(temp), "%s.tmp", index_file());
+	if ((fp = fopen(temp, "w")) == NULL) return;
+	fprintf(fp, "delve search index 1 %d\n", search.docs.count);
+	for (i = 0; i < search.docs.count; ++i) {
+		sel = &search.docs.items[i];
+		fprintf(fp, "%c%c%s\t%s\t%s\t%s\n", search.flags[i], sel->type, sel->name, sel->path, sel->host, sel->port);
+	}
+	fprintf(fp, "%d\n", search.term_count);
+	for (i = 0; i < search.term_count; ++i) {
+		term = &search.terms[i];
+		fprintf(fp, "%s %d %d %lu\n", term->word, term->last, term->count, (unsigned long)term->length);
+		fwrite(term->postings, 1, term->length, fp);
+		fputc('\n', fp);
+	}
+	if (fclose(fp) == 0) rename(temp, index_file());
+	else remove(temp);
+}
+
+
+/* a visited menu is found by its name and info lines, its links by their names */
+void index_menu(Selector *to, SelectorList *list) {
+	Selector *sel;
+	int i;
+
+	if (to->type != '1' || !load_index() || known_doc(to, DOC_VISITED)) return;
+	add_words(to->name, strlen(to->name));
+	for (i = 0; i < list->count; ++i) {
+		if (list->items[i].type == 'i') add_words(list->items[i].name, strlen(list->items[i].name));
+	}
+	add_doc(to, DOC_VISITED);
+	for (i = 0; i < list->count; ++i) {
+		sel = &list->items[i];
+		if (strchr("i3", sel->type) || known_doc(sel, DOC_LINK)) continue;
+		add_words(sel->name, strlen(sel->name));
+		add_doc(sel, DOC_LINK);
+	}
+}
+
+
+void index_text(Selector *to, const char *text, size_t length) {
+	size_t limit = (size_t)get_var_integer("INDEX_TEXT_SIZE", 1024) * 1024;
+
+	if (!load_index() || known_doc(to, DOC_VISITED)) return;
+	add_words(to->name, strlen(to->name));
+	add_words(text, length < limit ? length : limit);
+	add_doc(to, DOC_VISITED);
+}
+
+
+int compare_hits(const void *a, const void *b) {
+	const Hit *x = a, *y = b;
+	if (x->score != y->score) return x->score < y->score ? 1 : -1;
+	return y->doc - x->doc; /* newer documents first */
+}
+
+
+/* intersects the postings of all given words, ranked by the term frequencies weighted by their rarity */
+int find_documents(const char *terms, SelectorList *results) {
+	const char *end = terms + strlen(terms);
+	const unsigned char *p, *stop;
+	char word[MAX_WORD + 1];
+	unsigned long frequency;
+	int i, j, doc, next, count = 0, found, first = 1, limit = get_var_integer("FIND_RESULTS", 100);
+	Hit *hits = NULL;
+	Selector sel;
+	Term *term;
+
+	init_selector_list(results, 0);
+	if (!load_index()) return 0;
+	while (next_word(&terms, end, word)) {
+		if ((term = find_term(word, 0)) == NULL) { count = 0; break; }
+		if (first && (hits = malloc((term->count + 1) * sizeof(Hit))) == NULL) panic("cannot allocate search results");
+		p = term->postings;
+		stop = p + term->length;
+		for (doc = -1, j = found = 0; first || j < count; ) {
+			if ((next = next_posting(&p, stop, doc, &frequency)) == -1) break;
+			if (next == -2 || (first && found == term->count)) {
+				free(hits);
+				drop_index();
+				return 0;
+			}
+			doc = next;
+			/* both lists are sorted, the surviving hits are compacted in place */
+			if (!first) {
+				while (j < count && hits[j].doc < doc) ++j;
+				if (j == count || hits[j].doc != doc) continue;
+				hits[found] = hits[j++];
+			} else {
+				hits[found].doc = doc;
+				hits[found].score = 0;
+			}
+			hits[found++].score += (double)frequency * search.docs.count / term->count;
+		}
+		count = found;
+		first = 0;
+		if (count == 0) break;
+	}
+
+	if (count) qsort(hits, count, sizeof(Hit), compare_hits);
+	for (i = 0; i < count && results->count < limit; ++i) {
+		if (search.flags[hits[i].doc] == DOC_REPLACED) continue;
+		copy_selector(&sel, &search.docs.items[hits[i].doc]);
+		append_selector(results, &sel);
+	}
+	free(hits);
+	return results->count;
+}
+
+
+/*============================================================================*/
+const char *data_directory() {
+	static char buffer[1024];
+	char *dir;
+
+	if ((dir = set_var(&variables, "DATA_DIRECTORY", NULL)) != NULL) return dir;
+	if ((dir = getenv("XDG_DATA_HOME")) != NULL && *dir) snprintf(buffer, sizeof(buffer), "%s/delve", dir);
+	else if ((dir = getenv("HOME")) != NULL) snprintf(buffer, sizeof(buffer), "%s/.local/share/delve", dir);
+	else return "";
+	return buffer;
+}
+
+
+const char *log_file(Log *log) {
+	static char buffer[1024];
+	snprintf(buffer, sizeof(buffer), "%s/%s", data_directory(), log->name);
+	return buffer;
+}
+
+
+int format_record(char *buffer, size_t size, char op, Selector *sel) {
+	int length = snprintf(buffer, size, "%c%c%s\t%s\t%s\t%s\n", op, sel->type, sel->name, sel->path, sel->host, sel->port);
+	return length > 0 && (size_t)length < size ? length : 0;
+}
+
+
+/* records are single lines, written with one write() so sessions running side by side don't mix them up */
+void write_record(Log *log, char op, Selector *sel) {
+	char buffer[4096];
+	int length;
+
+	if (log->fd == -1) return;
+	if (op == '-') length = snprintf(buffer, sizeof(buffer), "-\n");
+	else if ((length = format_record(buffer, sizeof(buffer), op, sel)) == 0) return;
+	if (write_all(log->fd, buffer, length)) ++log->records;
+}
+
+
+void compact_log(Log *log) {
+	char temp[1032], buffer[4096];
+	int i, length, fd;
+
+	snprintf(temp, sizeof(temp), "%s.tmp", log_file(log));
+	if ((fd = open(temp, O_WRONLY | O_CLOEXEC | O_CREAT | O_TRUNC, 0600)) == -1) return;
+	for (i = log->first; i < log->list->count; ++i) {
+		if ((length = format_record(buffer, sizeof(buffer), '+', &log->list->items[i])) == 0) continue;
+		if (!write_all(fd, buffer, length)) break;
+	}
+	if (close(fd) == 0 && i == log->list->count && rename(temp, log_file(log)) == 0) log->records = i - log->first;
+	else remove(temp);
+}
+
+
+/* replays the log into its list, the entries already there came from the config files and are not logged */
+void open_log(Log *log) {
+	SelectorList *list = log->list;
+	char *data, *p, *end, *next, line[4096], *str;
+	Selector sel, copy;
+	struct stat st;
+	int fd;
+
+	if (!*data_directory() || !make_directory(data_directory(), 0700)) return;
+	log->first = list->count;
+	if ((fd = open(log_file(log), O_RDONLY | O_CLOEXEC)) != -1) {
+		if (fstat(fd, &st) == 0 && st.st_size > 0 && (data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) != MAP_FAILED) {
+			for (p = data, end = data + st.st_size; (next = memchr(p, '\n', end - p)) != NULL; p = next + 1) {
+				++log->records;
+				if (*p == '-') {
+					if (list->count > log->first) free_selector(&list->items[--list->count]);
+					continue;
+				}
+				if (*p != '+' || next - p < 2 || next - p >= (long)sizeof(line)) continue;
+				memcpy(line, p, next - p);
+				line[next - p] = '\0';
+				str = line + 2;
+				sel.type = line[1];
+				sel.name = next_field(&str);
+				sel.path = next_field(&str);
+				sel.host = next_field(&str);
+				sel.port = next_field(&str);
+				copy_selector(&copy, &sel);
+				if (log->unique) visit_selector(&copy);
+				else append_selector(list, &copy);
+			}
+			munmap(data, st.st_size);
+			list->generation = ++list_generation;
+		}
+		close(fd);
+	}
+	/* rewrite the log only once dropped entries make up most of it */
+	if (log->records > (list->count - log->first) * 2 + 64) compact_log(log);
+	log->fd = open(log_file(log), O_WRONLY | O_CLOEXEC | O_APPEND | O_CREAT, 0600);
+}
+
+
+void close_log(Log *log) {
+	if (log->fd != -1) close(log->fd);
+	log->fd = -1;
+}
+
+
+/*============================================================================*/
+long now_ms() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000L + ts.tv_nsec / 1000000L;
+}
+
+
+void free_host(Host *host) {
+	while (host) {
+		Host *next = host->next;
+		if (host->addresses) freeaddrinfo(host->addresses);
+		free(host);
+		host = next;
+	}
+}
+
+
+struct addrinfo *resolve(const char *name, const char *port) {
+	struct addrinfo hints, *result;
+	Host **it, *host;
+	int ttl = get_var_integer("DNS_TTL", 300);
+
+	for (it = &hosts; *it; it = &(*it)->next) {
+		if (((*it)->name != name && strcasecmp((*it)->name, name)) || strcmp((*it)->port, port)) continue;
+		if (ttl >= 0 && time(NULL) - (*it)->stamp > ttl) {
+			host = *it;
+			*it = host->next;
+			host->next = NULL;
+			free_host(host);
+			break;
+		}
+		return (*it)->addresses;
+	}
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_protocol = IPPROTO_TCP;
+
+	if (getaddrinfo(name, port, &hints, &result) || result == NULL) return NULL;
+	if ((host = malloc(sizeof(Host))) == NULL) panic("cannot allocate new host");
+	host->name = intern_string(name);
+	host->port = intern_string(port);
+	host->addresses = result;
+	host->stamp = time(NULL);
+	host->next = hosts;
+	hosts = host;
+	return result;
+}
+
+
+int sort_addresses(struct addrinfo *result, struct addrinfo **sorted, int max) {
+	struct addrinfo *it, *first = NULL, *second = NULL;
+	int n = 0, done;
+
+	/* alternate between the address families, starting with the preferred one (RFC 8305) */
+	do {
+		done = 1;
+		for (it = first ? first->ai_next : result; it && it->ai_family != result->ai_family; it = it->ai_next) ;
+		if (it && n < max) { sorted[n++] = first = it; done = 0; }
+		for (it = second ? second->ai_next : result; it && it->ai_family == result->ai_family; it = it->ai_next) ;
+		if (it && n < max) { sorted[n++] = second = it; done = 0; }
+	} while (!done);
+	return n;
+}
+
+
+void show_progress(size_t total) {
+	if (!batch && total > (1024 * 256)) printf("downloading %.2f kb...\r", (double)total / 1024.0);
+}
+
+
+/* keeps the timings of a finished transfer, `set TRACE on` shows them right away */
+void record_transfer(Transfer *t) {
+	Sample *sample = &stats.samples[stats.count++ % 256];
+	long long now = now_us();
+
+	sample->host = t->sel.host;
+	sample->failed = t->state != DONE;
+	sample->bytes = t->received;
+	/* a step which never finished lasted until now */
+	sample->dns = (t->resolved ? t->resolved : now) - t->created;
+	sample->connect = t->resolved ? (t->established ? t->established : now) - t->resolved : 0;
+	sample->first_byte = t->established ? (t->first_byte ? t->first_byte : now) - t->established : 0;
+	sample->transfer = t->first_byte ? now - t->first_byte : 0;
+
+	if (get_var_boolean("TRACE")) {
+		notify(esc_info, "%s %s %lu bytes, dns %.1f ms, connect %.1f ms, first byte %.1f ms, transfer %.1f ms, %.1f kb/s",
+			print_selector(&t->sel, 1), sample->failed ? "failed after" : "received",
+			(unsigned long)sample->bytes, sample->dns / 1000.0, sample->connect / 1000.0,
+			sample->first_byte / 1000.0, sample->transfer / 1000.0,
+			sample->transfer > 0 ? sample->bytes * 1000000.0 / 1024.0 / sample->transfer : 0.0);
+	}
+}
+
+
+void close_transfer(Transfer *t) {
+	int i;
+#ifdef DELVE_USE_TLS
+	if (t->ssl) SSL_free(t->ssl);
+	t->ssl = NULL;
+#endif /* DELVE_USE_TLS */
+	for (i = 0; i < t->pending; ++i) close(t->attempts[i]);
+	t->pending = 0;
+	if (t->fd != -1) close(t->fd);
+	if (t->pipe[0] != -1) { close(t->pipe[0]); close(t->pipe[1]); }
+	t->fd = t->pipe[0] = t->pipe[1] = -1;
+}
+
+
+void fail_transfer(Transfer *t, const char *fmt, ...) {
+	if (!t->quiet) {
+		va_list va;
+		va_start(va, fmt);
+		vlogf(esc_error, fmt, va);
+		va_end(va);
+	}
+	close_transfer(t);
+	t->state = FAILED;
+	record_transfer(t);
+}
+
+
+void free_transfer(Transfer *t) {
+	Transfer **it;
+	for (it = &transfers; *it; it = &(*it)->next) {
+		if (*it == t) { *it = t->next; break; }
+	}
+	close_transfer(t);
+	if (t->temp != -1) close(t->temp);
+	free_buffer(&t->buf);
+	free_selector(&t->sel);
+	free(t);
+}
+
+
+/* socket options of every connection attempt, see the RECV_BUFFER and TCP_* variables */
+void tune_socket(Transfer *t, int fd) {
+	int on = 1, size = get_var_integer("RECV_BUFFER", 0) * 1024;
+
+	if (size > 0) setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+	if (get_var_boolean("TCP_NODELAY")) setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+#ifdef TCP_QUICKACK
+	if ((t->quickack = get_var_boolean("TCP_QUICKACK"))) setsockopt(fd, IPPROTO_TCP, TCP_QUICKACK, &on, sizeof(on));
+#endif /* TCP_QUICKACK */
+}
+
+
+/*============================================================================*/
+#ifdef DELVE_USE_TLS
+Session *find_session(const char *host, const char *port, int create) {
+	Session *entry;
+
+	for (entry = sessions; entry; entry = entry->next) {
+		if (entry->host == host && entry->port == port) return entry;
+	}
+	if (!create) return NULL;
+	if ((entry = malloc(sizeof(Session))) == NULL) panic("cannot allocate TLS session");
+	entry->host = host;
+	entry->port = port;
+	entry->session = NULL;
+	entry->plain = 0;
+	entry->next = sessions;
+	sessions = entry;
+	return entry;
+}
+
+
+const char *sessions_file() {
+	static char buffer[1024];
+	snprintf(buffer, sizeof(buffer), "%s/sessions", cache_directory());
+	return buffer;
+}
+
+
+/* one line per host: <host> <port> <hex encoded session> */
+void load_sessions() {
+	char line[1024 * 16], *str, *host, *port, *hex;
+	unsigned char der[1024 * 8];
+	const unsigned char *p;
+	SSL_SESSION *session;
+	size_t i, length;
+	FILE *fp;
+
+	if (!*cache_directory() || (fp = fopen(sessions_file(), "r")) == NULL) return;
+	while (fgets(line, sizeof(line), fp)) {
+		str = line;
+		host = str_split(&str, "\t");
+		port = str_split(&str, "\t");
+		hex = str_split(&str, "\r\n");
+		if (!host || !port || !hex || (length = strlen(hex) / 2) > sizeof(der)) continue;
+		for (i = 0; i < length && sscanf(hex + i * 2, "%2hhx", &der[i]) == 1; ++i) ;
+		p = der;
+		if (i < length || (session = d2i_SSL_SESSION(NULL, &p, length)) == NULL) continue;
+		if (SSL_SESSION_get_time(session) + SSL_SESSION_get_timeout(session) < time(NULL)) {
+			SSL_SESSION_free(session); /* expired */
+			continue;
+		}
+		find_session(intern_string(host), intern_string(port), 1)->session = session;
+	}
+	fclose(fp);
+}
+
+
+void save_sessions() {
+	char temp[1032], *hex;
+	unsigned char *der, *p;
+	Session *entry;
+	int i, length, fd;
+	FILE *fp;
+
+	if (!sessions_dirty || !*cache_directory() || !make_directory(cache_directory(), 0700)) return;
+	snprintf(temp, sizeof(temp), "%s.tmp", sessions_file());
+	/* the sessions resume the encryption, so nobody else may read them */
+	if ((fd = open(temp, O_WRONLY | O_CLOEXEC | O_CREAT | O_TRUNC, 0600)) == -1 || (fp = fdopen(fd, "w")) == NULL) {
+		if (fd != -1) close(fd);
+		return;
+	}
+	for (entry = sessions; entry; entry = entry->next) {
+		if (entry->session == NULL || (length = i2d_SSL_SESSION(entry->session, NULL)) <= 0) continue;
+		if ((der = malloc(length)) == NULL || (hex = malloc(length * 2 + 1)) == NULL) panic("cannot allocate TLS session");
+		p = der;
+		i2d_SSL_SESSION(entry->session, &p);
+		for (i = 0; i < length; ++i) sprintf(hex + i * 2, "%02x", der[i]);
+		fprintf(fp, "%s\t%s\t%s\n", entry->host, entry->port, hex);
+		free(der);
+		free(hex);
+	}
+	if (fclose(fp) == 0) rename(temp, sessions_file());
+	else remove(temp);
+	sessions_dirty = 0;
+}
+
+
+void free_sessions() {
+	Session *next;
+	for (; sessions; sessions = next) {
+		next = sessions->next;
+		if (sessions->session) SSL_SESSION_free(sessions->session);
+		free(sessions);
+	}
+	if (tls) SSL_CTX_free(tls);
+	tls = NULL;
+}
+
+
+/* called for every session (ticket) the server hands out, the newest one is used for the next connection */
+int new_session(SSL *ssl, SSL_SESSION *session) {
+	Transfer *t = SSL_get_app_data(ssl);
+	Session *entry = find_session(t->sel.host, t->sel.port, 1);
+
+	if (entry->session) SSL_SESSION_free(entry->session);
+	entry->session = session;
+	sessions_dirty = 1;
+	return 1; /* we keep the reference */
+}
+
+
+SSL_CTX *tls_context() {
+	if (tls) return tls;
+	if ((tls = SSL_CTX_new(TLS_client_method())) == NULL) panic("cannot create TLS context");
+	SSL_CTX_set_default_verify_paths(tls);
+#ifdef SSL_OP_IGNORE_UNEXPECTED_EOF
+	SSL_CTX_set_options(tls, SSL_OP_IGNORE_UNEXPECTED_EOF); /* gopher servers just close the connection */
+#endif /* SSL_OP_IGNORE_UNEXPECTED_EOF */
+	/* we keep the sessions ourselves, by host rather than by session id */
+	SSL_CTX_set_session_cache_mode(tls, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+	SSL_CTX_sess_set_new_cb(tls, new_session);
+	load_sessions();
+	return tls;
+}
+
+
+/* TLS is `on`, `auto` (fall back to plain text for hosts which don't speak it) or off */
+int tls_auto() {
+	const char *mode = set_var(&variables, "TLS", NULL);
+	return mode && !strcasecmp(mode, "auto");
+}
+
+
+int wants_tls(Transfer *t) {
+	const char *mode = set_var(&variables, "TLS", NULL);
+	Session *entry;
+
+	if (mode == NULL) return 0;
+	if (!strcasecmp(mode, "on") || !strcasecmp(mode, "true")) return 1;
+	if (!tls_auto()) return 0;
+	tls_context(); /* loads the sessions */
+	return (entry = find_session(t->sel.host, t->sel.port, 0)) == NULL || !entry->plain;
+}
+
+
+int tls_verify() {
+	return find_var(&variables, "TLS_VERIFY") == NULL || get_var_boolean("TLS_VERIFY");
+}
+
+
+/* addresses get neither SNI nor a check of the DNS names in the certificate */
+int is_address(const char *host) {
+	unsigned char addr[sizeof(struct in6_addr)];
+	return inet_pton(AF_INET, host, addr) == 1 || inet_pton(AF_INET6, host, addr) == 1;
+}
+
+
+int start_tls(Transfer *t, long now) {
+	const char *host = t->sel.host;
+	int address = is_address(host);
+	Session *entry;
+
+	if ((t->ssl = SSL_new(tls_context())) == NULL || !SSL_set_fd(t->ssl, t->fd)) return 0;
+	entry = find_session(t->sel.host, t->sel.port, 0); /* the context has loaded them */
+	SSL_set_app_data(t->ssl, t);
+	if (!address) SSL_set_tlsext_host_name(t->ssl, host);
+	if (tls_verify()) {
+		SSL_set_verify(t->ssl, SSL_VERIFY_PEER, NULL);
+		if (address) X509_VERIFY_PARAM_set1_ip_asc(SSL_get0_param(t->ssl), host); /* matched against the IP SANs */
+		else SSL_set1_host(t->ssl, host);
+	}
+	if (entry && entry->session) SSL_set_session(t->ssl, entry->session); /* resume it, that saves a round trip */
+	t->state = HANDSHAKE;
+	t->events = POLLOUT;
+	/* plain text servers usually wait for the end of the selector, so don't wait too long for them */
+	t->deadline = now + get_var_integer("TLS_TIMEOUT", 3) * 1000L;
+	return 1;
+}
+
+
+/* returns 0 when the server doesn't speak TLS and we may fall back to plain text */
+int tls_handshake(Transfer *t) {
+	const char *reason;
+	int result;
+
+	/* a resumed session keeps the result of its first handshake, which might not have been verified */
+	if ((result = SSL_connect(t->ssl)) == 1 && (!tls_verify() || SSL_get_verify_result(t->ssl) == X509_V_OK)) {
+		++stats.handshakes;
+		if (SSL_session_reused(t->ssl)) ++stats.resumed;
+		t->state = SENDING;
+		return 1;
+	}
+	if (result != 1) switch (SSL_get_error(t->ssl, result)) {
+		case SSL_ERROR_WANT_READ: t->events = POLLIN; return 1;
+		case SSL_ERROR_WANT_WRITE: t->events = POLLOUT; return 1;
+	}
+	if (SSL_get_verify_result(t->ssl) == X509_V_OK && tls_auto()) {
+		ERR_clear_error();
+		return 0;
+	}
+	if (SSL_get_verify_result(t->ssl) != X509_V_OK) reason = X509_verify_cert_error_string(SSL_get_verify_result(t->ssl));
+	else if ((reason = ERR_reason_error_string(ERR_peek_last_error())) == NULL) reason = "connection closed";
+	fail_transfer(t, "TLS handshake with `%s` failed: %s", t->sel.host, reason);
+	ERR_clear_error();
+	return 1;
+}
+
+
+/* the results of send() and recv(), EAGAIN while the connection waits for the other direction */
+ssize_t tls_result(Transfer *t, int result) {
+	if (result > 0) return result;
+	switch (SSL_get_error(t->ssl, result)) {
+		case SSL_ERROR_WANT_READ: case SSL_ERROR_WANT_WRITE: errno = EAGAIN; return -1;
+		case SSL_ERROR_ZERO_RETURN: SSL_shutdown(t->ssl); return 0; /* a clean end keeps the session resumable */
+		case SSL_ERROR_SYSCALL: if (errno == 0) return 0; break; /* closed without saying goodbye */
+		default: errno = EPROTO; break;
+	}
+	ERR_clear_error();
+	return -1;
+}
+#endif /* DELVE_USE_TLS */
+
+
+int encrypted(Transfer *t) {
+#ifdef DELVE_USE_TLS
+	return t->ssl != NULL;
+#else
+	(void)t;
+	return 0;
+#endif /* DELVE_USE_TLS */
+}
+
+
+ssize_t send_data(Transfer *t, const char *data, size_t length) {
+#ifdef DELVE_USE_TLS
+	if (t->ssl) return tls_result(t, SSL_write(t->ssl, data, length));
+#endif /* DELVE_USE_TLS */
+	return send(t->fd, data, length, 0);
+}
+
+
+/* TLS records carry at most 16 KiB, so nothing is left behind in OpenSSL for a buffer of at least that size */
+ssize_t receive_data(Transfer *t, char *buffer, size_t size) {
+#ifdef DELVE_USE_TLS
+	if (t->ssl) return tls_result(t, SSL_read(t->ssl, buffer, size));
+#endif /* DELVE_USE_TLS */
+	return recv(t->fd, buffer, size, 0);
+}
+
+
+void send_request(Transfer *t, long now) {
+	size_t length = strlen(t->request);
+	ssize_t sent;
+
+	if ((sent = send_data(t, t->request + t->sent, length - t->sent)) == -1) {
+		/* EINPROGRESS: a Fast Open connect without a cookie, the handshake is still going on */
+		if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR && errno != EINPROGRESS) {
+			fail_transfer(t, "cannot send request to `%s`: %s", t->sel.host, strerror(errno));
+		}
+		return;
+	}
+	if ((t->sent += sent) == length) t->state = RECEIVING;
+	t->deadline = now + t->timeout;
+}
+
+
+#ifdef DELVE_USE_TLS
+/* a server which doesn't speak TLS is connected to again, this time in plain text */
+void handshake(Transfer *t, long now) {
+	int speaks_tls = tls_handshake(t);
+
+	if (t->state == SENDING) {
+		t->deadline = now + t->timeout;
+		send_request(t, now);
+	}
+	if (t->state != HANDSHAKE || (speaks_tls && now < t->deadline)) return;
+	if (!tls_auto()) {
+		fail_transfer(t, "TLS handshake with `%s` timed out", t->sel.host);
+		return;
+	}
+	find_session(t->sel.host, t->sel.port, 1)->plain = 1;
+	SSL_free(t->ssl);
+	t->ssl = NULL;
+	close(t->fd);
+	t->fd = -1;
+	t->state = CONNECTING;
+	t->tried = t->started = 0;
+	t->deadline = now + get_var_integer("CONNECT_TIMEOUT", 10) * 1000L;
+	/* the caller starts the attempts */
+}
+#endif /* DELVE_USE_TLS */
+
+
+#ifdef TCP_FASTOPEN_CONNECT
+const char *address_key(char *buffer, size_t size, const struct sockaddr *addr, socklen_t length) {
+	char host[NI_MAXHOST], port[NI_MAXSERV];
+	if (getnameinfo(addr, length, host, sizeof(host), port, sizeof(port), NI_NUMERICHOST | NI_NUMERICSERV)) return NULL;
+	snprintf(buffer, size, "%s %s", host, port);
+	return buffer;
+}
+
+
+void remember_fast_open(int fd) {
+	struct sockaddr_storage addr;
+	socklen_t length = sizeof(addr);
+	char key[NI_MAXHOST + NI_MAXSERV];
+
+	if (getpeername(fd, (struct sockaddr*)&addr, &length) || !address_key(key, sizeof(key), (struct sockaddr*)&addr, length)) return;
+	if (set_lookup(&fast_open_index, hash_string(key))) return; /* known already, or a collision which just doesn't get it */
+	if (fast_open_count == fast_open_capacity) {
+		fast_open_capacity = fast_open_capacity ? fast_open_capacity * 2 : 64;
+		if ((fast_opens = realloc(fast_opens, fast_open_capacity * sizeof(char*))) == NULL) panic("cannot allocate addresses");
+	}
+	fast_opens[fast_open_count] = intern_string(key);
+	set_insert(&fast_open_index, hash_string(key), fast_open_count++);
+}
+
+
+/* only an address which won a race before gets it, and only one attempt per transfer */
+int fast_open(Transfer *t, Address *address, int fd) {
+	char key[NI_MAXHOST + NI_MAXSERV];
+	int on = 1, *id;
+
+	if (t->fast_open != -1 || !get_var_boolean("TCP_FASTOPEN")) return 0;
+#ifdef DELVE_USE_TLS
+	if (wants_tls(t)) return 0; /* the handshake has to go first */
+#endif /* DELVE_USE_TLS */
+	if (!address_key(key, sizeof(key), (struct sockaddr*)&address->addr, address->length)) return 0;
+	if ((id = set_lookup(&fast_open_index, hash_string(key))) == NULL || strcmp(fast_opens[*id], key)) return 0;
+	return setsockopt(fd, IPPROTO_TCP, TCP_FASTOPEN_CONNECT, &on, sizeof(on)) == 0;
+}
+#endif /* TCP_FASTOPEN_CONNECT */
+
+
+/* with TCP_FASTOPEN_CONNECT the SYN waits for the request, the attempt stays in the race until it is connected */
+int send_early(Transfer *t, int fd) {
+	ssize_t sent = send(fd, t->request, strlen(t->request), 0);
+	/* EINPROGRESS: there is no cookie, so a plain SYN went out */
+	if (sent == -1 && errno != EINPROGRESS && errno != EAGAIN && errno != EWOULDBLOCK) return -1;
+	t->fast_open = fd;
+	t->early = sent > 0 ? (size_t)sent : 0;
+	return 0;
+}
+
+
+void connected(Transfer *t, int fd, long now) {
+	int i;
+	for (i = 0; i < t->pending; ++i) if (t->attempts[i] != fd) close(t->attempts[i]);
+	t->pending = 0;
+	t->fd = fd;
+	t->state = SENDING;
+	t->established = now_us();
+	t->sent = fd == t->fast_open ? t->early : 0; /* the request might have gone out with the SYN */
+	t->fast_open = -1;
+#ifdef TCP_FASTOPEN_CONNECT
+	remember_fast_open(fd);
+#endif /* TCP_FASTOPEN_CONNECT */
+	t->timeout = get_var_integer("READ_TIMEOUT", 30) * 1000L;
+#ifdef DELVE_USE_TLS
+	if (wants_tls(t)) {
+		if (!start_tls(t, now)) fail_transfer(t, "cannot start TLS with `%s`", t->sel.host);
+		else handshake(t, now);
+		return;
+	}
+#endif /* DELVE_USE_TLS */
+	send_request(t, now);
+}
+
+
+void start_attempts(Transfer *t, long now) {
+	/* start the next attempt when the previous ones are stalled for a while (RFC 8305) */
+	while (t->state == CONNECTING && t->tried < t->total && (t->pending == 0 || now - t->started >= 250)) {
+		Address *address = &t->addresses[t->tried++];
+		int fd = socket(address->family, SOCK_STREAM, IPPROTO_TCP), fast = 0, result;
+		t->started = now;
+		if (fd == -1) continue;
+		fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+		close_on_exec(fd);
+		tune_socket(t, fd);
+#ifdef TCP_FASTOPEN_CONNECT
+		fast = fast_open(t, address, fd);
+#endif /* TCP_FASTOPEN_CONNECT */
+		result = connect(fd, (struct sockaddr*)&address->addr, address->length);
+		if (result == 0 && fast) result = send_early(t, fd);
+		if (result == 0 && !fast) connected(t, fd, now);
+		else if (result == 0 || errno == EINPROGRESS) t->attempts[t->pending++] = fd;
+		else { close(fd); t->started = 0; }
+	}
+	if (t->state == CONNECTING && t->pending == 0 && t->tried >= t->total) {
+		fail_transfer(t, "cannot connect to `%s`:`%s`", t->sel.host, t->sel.port);
+	}
+}
+
+
+Transfer *new_transfer(Selector *sel, const char *query, Parser *parser, int out, void (*finish)(Transfer *t)) {
+	struct addrinfo *result, *sorted[16];
+	Transfer *t;
+	long now = now_ms();
+	int i;
+
+	if ((t = malloc(sizeof(Transfer))) == NULL) panic("cannot allocate new transfer");
+	copy_selector(&t->sel, sel);
+	if (query) snprintf(t->request, sizeof(t->request), "%s\t%s\r\n", sel->path, query);
+	else snprintf(t->request, sizeof(t->request), "%s\r\n", sel->path);
+	t->sent = t->received = 0;
+	t->fd = t->pipe[0] = t->pipe[1] = -1;
+	t->state = CONNECTING;
+	t->quiet = finish != NULL; /* nobody waits for background transfers, so don't disturb the user */
+	t->tried = t->total = t->pending = 0;
+	t->started = 0;
+	t->chunk = 1024 * 16;
+	t->quickack = t->events = 0;
+	t->fast_open = -1;
+	t->early = 0;
+#ifdef DELVE_USE_TLS
+	t->ssl = NULL;
+#endif /* DELVE_USE_TLS */
+	t->deadline = now + get_var_integer("CONNECT_TIMEOUT", 10) * 1000L;
+	t->timeout = 0;
+	init_buffer(&t->buf);
+	t->parser = parser;
+	t->out = out;
+	t->spill_at = 0;
+	t->temp = -1;
+	t->finish = finish;
+	t->data = NULL;
+	t->created = now_us();
+	t->resolved = t->established = t->first_byte = 0;
+	t->next = transfers;
+	transfers = t;
+
+	if ((result = resolve(sel->host, sel->port)) == NULL) {
+		fail_transfer(t, "cannot resolve hostname `%s`", sel->host);
+		return t;
+	}
+	t->resolved = now_us();
+	/* copy the addresses, the resolver cache might drop them while we are connecting */
+	for (t->total = sort_addresses(result, sorted, 16), i = 0; i < t->total; ++i) {
+		t->addresses[i].family = sorted[i]->ai_family;
+		t->addresses[i].length = sorted[i]->ai_addrlen;
+		memcpy(&t->addresses[i].addr, sorted[i]->ai_addr, sorted[i]->ai_addrlen);
+	}
+#ifdef __linux__
+	if (out != -1 && pipe2(t->pipe, O_CLOEXEC)) t->pipe[0] = t->pipe[1] = -1;
+#endif /* __linux__ */
+
+	start_attempts(t, now);
+	return t;
+}
+
+
+#ifdef __linux__
+/* move data from the socket to the file through a pipe without copying it to user space */
+ssize_t splice_to_file(Transfer *t, char *buffer, size_t size) {
+	ssize_t received, moved, left;
+
+	if ((received = splice(t->fd, NULL, t->pipe[1], NULL, size, SPLICE_F_MOVE | SPLICE_F_NONBLOCK)) <= 0) return received;
+	for (left = received; left > 0; left -= moved) {
+		if ((moved = splice(t->pipe[0], NULL, t->out, NULL, left, SPLICE_F_MOVE)) > 0) continue;
+		/* the file doesn't support splice, so write out what is still in the pipe and use recv() from now on */
+		for (; left > 0; left -= moved) {
+			if ((moved = read(t->pipe[0], buffer, (size_t)left < size ? (size_t)left : size)) <= 0) return -2;
+			if (!write_all(t->out, buffer, moved)) return -2;
+		}
+		close(t->pipe[0]);
+		close(t->pipe[1]);
+		t->pipe[0] = t->pipe[1] = -1;
+	}
+	return received;
+}
+#endif /* __linux__ */
+
+
+ssize_t receive_to_file(Transfer *t) {
+	char buffer[1024 * 64];
+	ssize_t received;
+
+#ifdef __linux__
+	if (t->pipe[0] != -1 && !encrypted(t)) { /* the data has to be decrypted first */
+		if ((received = splice_to_file(t, buffer, sizeof(buffer))) != -1 || errno != EINVAL) return received;
+		close(t->pipe[0]); /* splice isn't supported for this socket */
+		close(t->pipe[1]);
+		t->pipe[0] = t->pipe[1] = -1;
+	}
+#endif /* __linux__ */
+
+	if ((received = receive_data(t, buffer, sizeof(buffer))) > 0 && !write_all(t->out, buffer, received)) return -2;
+	return received;
+}
+
+
+/* creates an unlinked temporary file, it goes away with its last descriptor */
+int temp_file(char *filename, size_t size) {
+	char *tmpdir;
+	int fd;
+
+	if ((tmpdir = getenv("TMPDIR")) == NULL) tmpdir = "/tmp/";
+	snprintf(filename, size, "%sdelve.XXXXXXXX", tmpdir);
+	if ((fd = mkstemp(filename)) == -1) error("cannot create temporary file: %s", strerror(errno));
+	return close_on_exec(fd);
+}
+
+
+/* writes what was received so far into a temporary file, the rest of the response follows it there */
+int spill_transfer(Transfer *t) {
+	char filename[1024];
+	int fd;
+
+	if ((fd = temp_file(filename, sizeof(filename))) == -1) return 0;
+	remove(filename);
+	if (!write_all(fd, t->buf.data, t->buf.length)) {
+		close(fd);
+		return 0;
+	}
+	free_buffer(&t->buf);
+	t->out = t->temp = fd;
+#ifdef __linux__
+	if (pipe2(t->pipe, O_CLOEXEC)) t->pipe[0] = t->pipe[1] = -1;
+#endif /* __linux__ */
+	return 1;
+}
+
+
+void receive(Transfer *t, long now) {
+	ssize_t received;
+
+	if (t->out != -1) received = receive_to_file(t);
+	else if ((received = receive_data(t, reserve_buffer(&t->buf, t->chunk), t->chunk)) == (ssize_t)t->chunk && t->chunk < 1024 * 1024) {
+		t->chunk *= 2; /* the data arrives faster than we read it */
+	}
+#ifdef TCP_QUICKACK
+	if (t->quickack) setsockopt(t->fd, IPPROTO_TCP, TCP_QUICKACK, &t->quickack, sizeof(t->quickack));
+#endif /* TCP_QUICKACK */
+
+	if (received == -1 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) return;
+	if (received == -2 && errno == EPIPE) { /* the reader is gone, e.g. a handler which was quit early */
+		close_transfer(t);
+		t->state = DONE;
+		record_transfer(t);
+		return;
+	}
+	if (received == -2) {
+		fail_transfer(t, "cannot write downloaded data: %s", strerror(errno));
+		return;
+	}
+	if (received == -1) {
+		fail_transfer(t, "cannot receive data from `%s`: %s", t->sel.host, strerror(errno));
+		return;
+	}
+
+	if (t->received == 0 && received > 0) t->first_byte = now_us();
+	t->received += received;
+	t->deadline = now + t->timeout;
+	if (t->out == -1) {
+		t->buf.length += received;
+		t->buf.data[t->buf.length] = '\0'; /* reserve_buffer() always leaves room for this */
+		if (t->spill_at && t->buf.length > t->spill_at && !spill_transfer(t)) {
+			fail_transfer(t, "cannot write downloaded data: %s", strerror(errno));
+			return;
+		}
+	}
+	if (received == 0) {
+		close_transfer(t);
+		t->state = DONE;
+		record_transfer(t);
+	}
+
+	if (t->parser) parse_selector_chunk(t->parser, t->buf.data, t->buf.length, t->state == DONE);
+	else if (!t->quiet && !t->spill_at && received > 0) show_progress(t->received); /* streamed texts show their own */
+}
+
+
+void step_transfer(Transfer *t, struct pollfd *fds, long now) {
+	int i, err;
+	socklen_t length;
+
+	switch (t->state) {
+		case CONNECTING:
+			for (i = t->pending - 1; i >= 0 && i < t->pending && t->state == CONNECTING; --i) { /* a TLS fallback starts over */
+				if (fds[i].revents == 0) continue;
+				length = sizeof(err);
+				if (getsockopt(t->attempts[i], SOL_SOCKET, SO_ERROR, &err, &length) == 0 && err == 0) {
+					connected(t, t->attempts[i], now);
+				} else {
+					if (t->attempts[i] == t->fast_open) t->fast_open = -1;
+					close(t->attempts[i]);
+					t->attempts[i] = t->attempts[--t->pending];
+					t->started = 0; /* that one failed, so don't wait for the next attempt */
+				}
+			}
+			if (t->state != CONNECTING) break;
+			if (now >= t->deadline) fail_transfer(t, "cannot connect to `%s`:`%s`", t->sel.host, t->sel.port);
+			else start_attempts(t, now);
+			break;
+#ifdef DELVE_USE_TLS
+		case HANDSHAKE:
+			if (fds[0].revents || now >= t->deadline) handshake(t, now);
+			if (t->state == CONNECTING) start_attempts(t, now);
+			break;
+#endif /* DELVE_USE_TLS */
+		case SENDING:
+			if (fds[0].revents) send_request(t, now);
+			break;
+		case RECEIVING:
+			if (fds[0].revents) receive(t, now);
+			break;
+	}
+	if ((t->state == SENDING || t->state == RECEIVING) && t->timeout > 0 && now >= t->deadline) {
+		fail_transfer(t, "connection to `%s` timed out", t->sel.host);
+	}
+}
+
+
+long transfer_deadline(Transfer *t) {
+	switch (t->state) {
+		case CONNECTING:
+			if (t->tried < t->total && t->started + 250 < t->deadline) return t->started + 250;
+			return t->deadline;
+		case HANDSHAKE:
+			return t->deadline;
+		case SENDING: case RECEIVING:
+			return t->timeout > 0 ? t->deadline : -1;
+		default:
+			return t->finish ? 0 : -1; /* background transfers are handed back right away */
+	}
+}
+
+
+int engine_poll(int input, long timeout) {
+	static struct pollfd *fds = NULL;
+	static int capacity = 0;
+	Transfer *t;
+	long now = now_ms(), wait = timeout, deadline;
+	int n = 0, count, ready;
+
+	for (count = 1, t = transfers; t; t = t->next) count += t->state == CONNECTING ? t->pending : 1;
+	if (count > capacity) {
+		capacity = count * 2;
+		if ((fds = realloc(fds, capacity * sizeof(struct pollfd))) == NULL) panic("cannot allocate poll fds");
+	}
+
+	if (input != -1) {
+		fds[n].fd = input;
+		fds[n++].events = POLLIN;
+	}
+	for (t = transfers; t; t = t->next) {
+		t->first = n;
+		switch (t->state) {
+			case CONNECTING:
+				for (count = 0; count < t->pending; ++count) {
+					fds[n].fd = t->attempts[count];
+					fds[n++].events = POLLOUT;
+				}
+				break;
+			case HANDSHAKE: fds[n].fd = t->fd; fds[n++].events = t->events; break;
+			case SENDING: fds[n].fd = t->fd; fds[n++].events = POLLOUT; break;
+			case RECEIVING: fds[n].fd = t->fd; fds[n++].events = POLLIN; break;
+			default: break;
+		}
+		if ((deadline = transfer_deadline(t)) >= 0) {
+			deadline = deadline > now ? deadline - now : 0;
+			if (wait < 0 || deadline < wait) wait = deadline;
+		}
+	}
+	if (n == 0 && wait < 0) return 0; /* nothing to wait for */
+
+	for (count = 0; count < n; ++count) fds[count].revents = 0;
+	if (poll(fds, n, wait) == -1 && errno != EINTR) panic("cannot poll: %s", strerror(errno));
+	ready = input != -1 && fds[0].revents;
+
+	now = now_ms();
+	for (t = transfers; t; t = t->next) {
+		if (t->state < DONE) step_transfer(t, &fds[t->first], now);
+	}
+
+	/* hand finished background transfers back, the callbacks may start or cancel transfers */
+	for (;;) {
+		for (t = transfers; t && !(t->finish && t->state >= DONE); t = t->next) ;
+		if (t == NULL) break;
+		t->finish(t);
+		free_transfer(t);
+	}
+	return ready;
+}
+
+
+int run_transfer(Transfer *t) {
+	while (t->state < DONE) {
+		if (interrupted) fail_transfer(t, "cancelled `%s`", print_selector(&t->sel, 1));
+		else engine_poll(-1, -1);
+	}
+	if (!t->quiet && t->received > (1024 * 256) && t->parser == NULL) puts("");
+	return t->state == DONE;
+}
+
+
+void wait_for_input() {
+	fflush(stdout);
+	while (!interrupted && !engine_poll(STDIN_FILENO, -1)) ;
+}
+
+
+char *read_line(const char *fmt, ...) {
+	static char buffer[256];
+	char *line;
+	if (fmt != NULL) {
+		va_list va;
+		va_start(va, fmt);
+		vprintf(fmt, va);
+		va_end(va);
+		fflush(stdout);
+	}
+	wait_for_input();
+	if (interrupted) return NULL;
+	memset(buffer, 0, sizeof(buffer));
+	if ((line = fgets(buffer, sizeof(buffer), stdin)) == NULL) return NULL;
+	line = str_skip(line, " \v\t");
+	line = str_split(&line, "\r\n");
+	return line ? line : "";
+}
+
+
+char *download(Selector *sel, const char *query, Buffer *buf) {
+	Transfer *t = new_transfer(sel, query, NULL, -1, NULL);
+
+	init_buffer(buf);
+	if (run_transfer(t)) {
+		*buf = t->buf;
+		init_buffer(&t->buf);
+	}
+	free_transfer(t);
+	return buf->data;
+}
+
+
+int download_to_fd(Selector *sel, int out) {
+	Transfer *t = new_transfer(sel, NULL, NULL, out, NULL);
+	int ok = run_transfer(t);
+	free_transfer(t);
+	return ok;
+}
+
+
+void init_queue(Queue *queue, int limit, int host_limit, Transfer *(*start)(Queue *queue, Selector *sel)) {
+	init_selector_list(&queue->list, 0);
+	queue->next = queue->done = queue->failed = 0;
+	queue->limit = limit > 0 ? limit : 1;
+	queue->host_limit = host_limit > 0 ? host_limit : queue->limit;
+	queue->received = 0;
+	queue->start = start;
+}
+
+
+int queue_running(Queue *queue, const char *host, int *same_host) {
+	Transfer *t;
+	int running;
+
+	for (running = 0, *same_host = 0, t = transfers; t; t = t->next) {
+		if (t->data != queue || t->state >= DONE) continue;
+		++running;
+		if (t->sel.host == host) ++*same_host;
+	}
+	return running;
+}
+
+
+void start_queue(Queue *queue) {
+	Transfer *t;
+	Selector *sel, swap;
+	int i, same_host;
+
+	while (queue->next < queue->list.count && queue_running(queue, NULL, &same_host) < queue->limit) {
+		/* take the next one from a host that isn't busy, so one slow host doesn't hold up the others */
+		for (i = queue->next; i < queue->list.count; ++i) {
+			queue_running(queue, queue->list.items[i].host, &same_host);
+			if (same_host < queue->host_limit) break;
+		}
+		if (i == queue->list.count) break;
+		swap = queue->list.items[i];
+		queue->list.items[i] = queue->list.items[queue->next];
+		queue->list.items[queue->next] = swap;
+
+		sel = &queue->list.items[queue->next++];
+		/* the start function counts the selectors it didn't start a transfer for */
+		if ((t = queue->start(queue, sel)) != NULL) t->data = queue;
+	}
+}
+
+
+/* to be called by the finish callbacks of queued transfers */
+void queue_done(Transfer *t) {
+	Queue *queue = t->data;
+
+	if (t->state == DONE) {
+		++queue->done;
+		queue->received += t->received;
+	} else ++queue->failed;
+	t->data = NULL;
+	start_queue(queue);
+}
+
+
+int queue_finished(Queue *queue) {
+	Transfer *t;
+	if (queue->next < queue->list.count) return 0;
+	for (t = transfers; t; t = t->next) if (t->data == queue) return 0; /* not handed back yet */
+	return 1;
+}
+
+
+void cancel_queue(Queue *queue) {
+	Transfer *t;
+	queue->next = queue->list.count;
+	/* let the finish callbacks clean up after them */
+	for (t = transfers; t; t = t->next) if (t->data == queue && t->state < DONE) fail_transfer(t, "cancelled");
+}
+
+
+size_t queue_received(Queue *queue) {
+	Transfer *t;
+	size_t received = queue->received;
+	for (t = transfers; t; t = t->next) if (t->data == queue) received += t->received;
+	return received;
+}
+
+
+void free_queue(Queue *queue) {
+	Transfer *t, *next;
+	for (t = transfers; t; t = next) {
+		next = t->next;
+		if (t->data == queue) free_transfer(t);
+	}
+	free_selector_list(&queue->list);
+	queue->next = 0;
+}
+
+
+char *download_to_temp(Selector *sel) {
+	static char filename[1024];
+	int fd;
+
+	if ((fd = temp_file(filename, sizeof(filename))) == -1) return NULL;
+	if (!download_to_fd(sel, fd)) {
+		close(fd);
+		remove(filename);
+		return NULL;
+	}
+	close(fd);
+	return filename;
+}
+
+
+/* starts `command` right away and streams the response into its stdin */
+void download_to_command(Selector *sel, const char *command) {
+	struct sigaction sa, old;
+	Transfer *t;
+	pid_t pid;
+	int fds[2], status, ok;
+
+	if (pipe(fds)) {
+		error("cannot create pipe: %s", strerror(errno));
+		return;
+	}
+	close_on_exec(fds[0]); /* dup2() clears it for the stdin of the handler */
+	close_on_exec(fds[1]);
+	fflush(stdout);
+	if ((pid = fork()) == -1) {
+		error("could not execute `%s`: %s", command, strerror(errno));
+		close(fds[0]);
+		close(fds[1]);
+		return;
+	}
+	if (pid == 0) {
+		close(fds[1]);
+		dup2(fds[0], STDIN_FILENO);
+		close(fds[0]);
+		execl("/bin/sh", "sh", "-c", command, (char*)NULL);
+		_exit(127);
+	}
+	close(fds[0]);
+
+	/* a handler which quits early closes the pipe, that is no reason to die */
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = SIG_IGN;
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGPIPE, &sa, &old);
+	t = new_transfer(sel, NULL, NULL, fds[1], NULL);
+	t->quiet = 1; /* the handler owns the terminal now */
+	ok = run_transfer(t);
+	free_transfer(t);
+	close(fds[1]);
+	sigaction(SIGPIPE, &old, NULL);
+
+	while (waitpid(pid, &status, 0) == -1 && errno == EINTR) ;
+	if (!ok && !interrupted) error("cannot download `%s`", print_selector(sel, 1));
+}
+
+
+const char *save_filename(char *buffer, size_t size, Selector *sel) {
+	char *name, *download_dir;
+
+	if ((name = strrchr(sel->path, '/')) != NULL) ++name;
+	else name = sel->path;
+	if ((download_dir = set_var(&variables, "DOWNLOAD_DIRECTORY", NULL)) == NULL) download_dir = ".";
+	snprintf(buffer, size, "%s/%s", download_dir, *name ? name : "index");
+	return buffer;
+}
+
+
+void download_to_file(Selector *sel) {
+	char *filename, suggestion[1024], partial[1040];
+	int fd;
+
+	save_filename(suggestion, sizeof(suggestion), sel);
+
+	if ((filename = read_line("enter filename (press ENTER for `%s`): ", suggestion)) == NULL) return;
+	if (!strlen(filename)) filename = suggestion;
+
+	/* stream into a partial file first, so a failed download won't clobber an existing file */
+	snprintf(partial, sizeof(partial), "%s.part", filename);
+	if ((fd = open(partial, O_WRONLY | O_CLOEXEC | O_CREAT | O_TRUNC, 0644)) == -1) {
+		error("cannot create file `%s`: %s", partial, strerror(errno));
+		return;
+	}
+	if (!download_to_fd(sel, fd)) {
+		close(fd);
+		remove(partial);
+		return;
+	}
+	close(fd);
+	if (rename(partial, filename)) {
+		error("cannot create file `%s`: %s", filename, strerror(errno));
+		remove(partial);
+	}
+}
+
+
+/* the name of a queued selector is the file it is saved as, see queue_save() */
+void save_done(Transfer *t) {
+	char partial[1040];
+
+	close(t->out);
+	snprintf(partial, sizeof(partial), "%s.part", t->sel.name);
+	if (t->state != DONE || rename(partial, t->sel.name)) {
+		remove(partial);
+		fputs(esc_clear, stdout); /* clear the status line */
+		error("cannot save `%s` as `%s`", print_selector(&t->sel, 1), t->sel.name);
+		t->state = FAILED;
+	}
+	queue_done(t);
+}
+
+
+Transfer *start_save(Queue *queue, Selector *sel) {
+	char partial[1040];
+	int fd;
+
+	snprintf(partial, sizeof(partial), "%s.part", sel->name);
+	if ((fd = open(partial, O_WRONLY | O_CLOEXEC | O_CREAT | O_TRUNC, 0644)) == -1) {
+		fputs(esc_clear, stdout);
+		error("cannot create file `%s`: %s", partial, strerror(errno));
+		++queue->failed;
+		return NULL;
+	}
+	return new_transfer(sel, NULL, NULL, fd, save_done);
+}
+
+
+/* `names` points into the queued selectors, which have the file names as their names */
+int name_taken(Queue *queue, Set *names, const char *name) {
+	int i, *id = set_lookup(names, hash_string(name));
+
+	if (id == NULL) return 0;
+	if (!strcmp(queue->list.items[*id].name, name)) return 1;
+	/* a hash collision, those names are compared one by one */
+	for (i = 0; i < queue->list.count; ++i) if (!strcmp(queue->list.items[i].name, name)) return 1;
+	return 0;
+}
+
+
+/* concurrent downloads need their own files, so a name taken already gets a number like `readme-2.txt` */
+void queue_save(Queue *queue, Selector *sel, const char *filter, Set *names) {
+	char filename[1024], unique[1040];
+	const char *base, *ext;
+	Selector copy;
+	int n;
+
+	if (strchr("i37", sel->type)) return; /* nothing to download for these */
+	if (filter && !str_contains(sel->name, filter) && !str_contains(sel->path, filter)) return;
+	save_filename(filename, sizeof(filename), sel);
+	base = strrchr(filename, '/') + 1;
+	if ((ext = strrchr(base, '.')) == NULL || ext == base) ext = base + strlen(base);
+	snprintf(unique, sizeof(unique), "%s", filename);
+	for (n = 2; name_taken(queue, names, unique); ++n) {
+		snprintf(unique, sizeof(unique), "%.*s-%d%s", (int)(ext - filename), filename, n, ext);
+	}
+	set_insert(names, hash_string(unique), queue->list.count); /* a collision just keeps the other name */
+	copy_selector(&copy, sel);
+	str_free(copy.name);
+	copy.name = str_copy(unique);
+	append_selector(&queue->list, &copy);
+}
+
+
+void download_many(char *line) {
+	Set names = { NULL, NULL, 0, 0 };
+	Queue queue;
+	char *filter, *end;
+	long from, to, i, shown = 0;
+
+	init_queue(&queue, get_var_integer("MAX_DOWNLOADS", 8), get_var_integer("MAX_HOST_DOWNLOADS", 4), start_save);
+	if (line[0] == '*') { /* everything in the menu, optionally filtered */
+		filter = str_skip(line + 1, " \t\v");
+		for (i = 0; i < menu.count; ++i) queue_save(&queue, &menu.items[i], *filter ? filter : NULL, &names);
+	} else { /* a list of item-ids and ranges like 3-40,52 */
+		for (end = line;; line = end + 1) {
+			from = to = strtol(line, &end, 10);
+			if (end == line) break;
+			if (*end == '-') {
+				to = strtol(line = end + 1, &end, 10);
+				if (end == line) to = menu.count; /* 3- means everything from 3 on */
+			}
+			for (i = from; i <= to; ++i) if (i > 0 && i <= menu.count) queue_save(&queue, &menu.items[i - 1], NULL, &names);
+			if (*end != ',') break;
+		}
+		if (*str_skip(end, " \t\v") != '\0') {
+			error("invalid item range `%s`", end);
+			free_queue(&queue);
+			free_set(&names);
+			return;
+		}
+	}
+
+	free_set(&names);
+	start_queue(&queue);
+	while (!queue_finished(&queue)) {
+		if (interrupted) cancel_queue(&queue);
+		engine_poll(-1, -1);
+		if (batch || now_ms() - shown < 100) continue;
+		shown = now_ms();
+		printf("%ssaved %d of %d files, %.2f kb...", esc_clear, queue.done, queue.list.count, (double)queue_received(&queue) / 1024.0);
+		fflush(stdout);
+	}
+	printf("%ssaved %d of %d files, %.2f kb\n", esc_clear, queue.done, queue.list.count, (double)queue.received / 1024.0);
+	free_queue(&queue);
+}
+
+
+/*============================================================================*/
+const char *mirror_filename(char *buffer, size_t size, const char *directory, Selector *sel) {
+	const char *path;
+	size_t l, n;
+
+	l = snprintf(buffer, size, "%s", directory);
+	for (path = sel->path; *path && l < size - 1; path += n) {
+		if ((n = strcspn(path, "/")) == 0) { ++path; continue; } /* skip empty components */
+		/* never leave the mirror directory */
+		if ((n == 1 && path[0] == '.') || (n == 2 && path[0] == '.' && path[1] == '.')) l += snprintf(buffer + l, size - l, "/_");
+		else l += snprintf(buffer + l, size - l, "/%.*s", (int)n, path);
+	}
+	if (l < size - 1 && sel->type == '1') snprintf(buffer + l, size - l, "/gophermap");
+	return buffer;
+}
+
+
+/* remembers the cache key of a selector, 0 if it was seen already */
+int mirror_key(Mirror *mirror, const char *key) {
+	unsigned long long hash = hash_string(key);
+	int i, *id = set_lookup(&mirror->seen, hash);
+
+	if (id && !strcmp(mirror->keys[*id], key)) return 0;
+	if (id) { /* a hash collision, those keys are compared one by one */
+		for (i = 0; i < mirror->key_count; ++i) if (!strcmp(mirror->keys[i], key)) return 0;
+	}
+	if (mirror->key_count == mirror->key_capacity) {
+		mirror->key_capacity = mirror->key_capacity ? mirror->key_capacity * 2 : 64;
+		if ((mirror->keys = realloc(mirror->keys, mirror->key_capacity * sizeof(char*))) == NULL) panic("cannot allocate selectors");
+	}
+	if (id == NULL) set_insert(&mirror->seen, hash, mirror->key_count);
+	mirror->keys[mirror->key_count++] = str_copy(key);
+	return 1;
+}
+
+
+void mirror_selector(Mirror *mirror, Selector *sel, int depth) {
+	char key[1024];
+	Selector copy, *root = mirror->queue.list.items;
+
+	if (depth > mirror->depth || strchr("i378T+", sel->type) || !strncmp(sel->path, "URL:", 4)) return;
+	/* only mirror the hole itself, not everything it links to */
+	if (root && ((sel->host != root->host && strcasecmp(sel->host, root->host)) || sel->port != root->port)) return;
+	snprintf(key, sizeof(key), "%s:%s/%s", sel->host, sel->port, sel->path);
+	if (!mirror_key(mirror, key)) return;
+	copy_selector(&copy, sel);
+	append_selector(&mirror->queue.list, &copy)->index = depth; /* the queue doesn't use the index */
+}
+
+
+void mirror_menu(Mirror *mirror, Selector *sel, const char *data, size_t length) {
+	char filename[1024];
+	SelectorList list;
+	int fd, i, depth = sel->index + 1; /* `sel` might move when the queue grows */
+
+	mirror_filename(filename, sizeof(filename), mirror->directory, sel);
+	if ((fd = open(filename, O_WRONLY | O_CLOEXEC | O_CREAT | O_TRUNC, 0644)) == -1 || !write_all(fd, data, length)) {
+		fputs(esc_clear, stdout);
+		error("cannot write file `%s`: %s", filename, strerror(errno));
+	}
+	if (fd != -1) close(fd);
+	parse_selector_list(&list, data, length);
+	for (i = 0; i < list.count; ++i) mirror_selector(mirror, &list.items[i], depth);
+	free_selector_list(&list);
+}
+
+
+void mirror_done(Transfer *t) {
+	Mirror *mirror = t->data;
+	char filename[1024], key[1024], partial[1040];
+
+	mirror_filename(filename, sizeof(filename), mirror->directory, &t->sel);
+	if (t->sel.type == '1') {
+		if (t->state == DONE) {
+			disk_cache_put(cache_key(key, sizeof(key), &t->sel, NULL), t->buf.data, t->buf.length);
+			mirror_menu(mirror, &t->sel, t->buf.data, t->buf.length);
+		}
+	} else {
+		close(t->out);
+		snprintf(partial, sizeof(partial), "%s.part", filename);
+		if (t->state != DONE || rename(partial, filename)) {
+			remove(partial);
+			t->state = FAILED;
+		}
+	}
+	if (t->state != DONE) {
+		fputs(esc_clear, stdout);
+		error("cannot mirror `%s`", print_selector(&t->sel, 1));
+	}
+	queue_done(t);
+}
+
+
+Transfer *start_mirror(Queue *queue, Selector *sel) {
+	Mirror *mirror = (Mirror*)queue;
+	char filename[1024], key[1024], partial[1040], *dir;
+	struct stat st;
+	Buffer buf;
+	Transfer *t;
+	int fd;
+
+	mirror_filename(filename, sizeof(filename), mirror->directory, sel);
+	if ((dir = strrchr(filename, '/')) != NULL) {
+		*dir = '\0';
+		make_directory(filename, 0755);
+		*dir = '/';
+	}
+
+	if (sel->type == '1') {
+		/* resume from the cache, so an interrupted mirror doesn't start all over again */
+		if (disk_cache_get(cache_key(key, sizeof(key), sel, NULL), &buf, 0)) {
+			mirror_menu(mirror, sel, buf.data, buf.length);
+			free_buffer(&buf);
+			++queue->done;
+			return NULL;
+		}
+		t = new_transfer(sel, NULL, NULL, -1, mirror_done);
+	} else {
+		if (stat(filename, &st) == 0) { /* already there from an earlier run */
+			++queue->done;
+			return NULL;
+		}
+		snprintf(partial, sizeof(partial), "%s.part", filename);
+		if ((fd = open(partial, O_WRONLY | O_CLOEXEC | O_CREAT | O_TRUNC, 0644)) == -1) {
+			fputs(esc_clear, stdout);
+			error("cannot create file `%s`: %s", partial, strerror(errno));
+			++queue->failed;
+			return NULL;
+		}
+		t = new_transfer(sel, NULL, NULL, fd, mirror_done);
+	}
+	t->sel.index = sel->index;
+	return t;
+}
+
+
+void mirror(Selector *sel, const char *directory, int depth) {
+	Mirror mirror;
+	long shown = 0;
+	int i;
+
+	init_queue(&mirror.queue, get_var_integer("MAX_DOWNLOADS", 8), get_var_integer("MAX_HOST_DOWNLOADS", 4), start_mirror);
+	memset(&mirror.seen, 0, sizeof(Set));
+	mirror.keys = NULL;
+	mirror.key_count = mirror.key_capacity = 0;
+	snprintf(mirror.directory, sizeof(mirror.directory), "%s", directory);
+	mirror.depth = depth;
+	mirror_selector(&mirror, sel, 0);
+
+	start_queue(&mirror.queue);
+	while (!queue_finished(&mirror.queue)) {
+		if (interrupted) cancel_queue(&mirror.queue);
+		engine_poll(-1, -1);
+		if (batch || now_ms() - shown < 100) continue;
+		shown = now_ms();
+		printf("%smirrored %d of %d selectors, %.2f kb...", esc_clear, mirror.queue.done, mirror.queue.list.count,
+			(double)queue_received(&mirror.queue) / 1024.0);
+		fflush(stdout);
+	}
+	printf("%smirrored %d of %d selectors, %.2f kb\n", esc_clear, mirror.queue.done, mirror.queue.list.count,
+		(double)mirror.queue.received / 1024.0);
+	free_queue(&mirror.queue);
+	free_set(&mirror.seen);
+	for (i = 0; i < mirror.key_count; ++i) str_free(mirror.keys[i]);
+	free(mirror.keys);
+}
+
+
+/*============================================================================*/
+void out(const char *data, size_t length) {
+	memcpy(reserve_buffer(&screen, length), data, length);
+	screen.length += length;
+}
+
+
+void out_string(const char *str) {
+	out(str, strlen(str));
+}
+
+
+/* `length` clamps the text, negative means no limit */
+void out_text(const char *color, const char *text, int length) {
+	size_t l = strlen(text);
+	if (length >= 0 && l > (size_t)length) l = length;
+	if (color) out_string(color);
+	out(text, l);
+	if (color) out_string(esc_reset);
+	out("\n", 1);
+}
+
+
+void out_index(int index) {
+	char buffer[16];
+	out(buffer, snprintf(buffer, sizeof(buffer), "%4d | ", index));
+}
+
+
+void flush_screen() {
+	fflush(stdout); /* whatever went through stdio came before */
+	if (screen.length && !write_all(STDOUT_FILENO, screen.data, screen.length)) panic("cannot write to terminal");
+	screen.length = 0;
+}
+
+
+char *read_pager(const char *hint) {
+	static char buffer[256];
+	char *line;
+
+	out_string(esc_pager);
+	out_string(hint);
+	out_string(esc_reset);
+	flush_screen(); /* the whole page leaves in one write */
+	wait_for_input(); /* transfers keep going while we wait for the user */
+	if (interrupted || (line = fgets(buffer, sizeof(buffer), stdin)) == NULL) return NULL;
+	line = str_skip(line, " \t\v");
+	line = str_split(&line, "\r\n");
+	return line ? line : "";
+}
+
+
+int show_pager_stop() {
+	char *line = read_pager("-- press RETURN to continue (or 'q' and return to quit) --");
+	return line == NULL || line[0] == 'q' || line[0] == 'Q';
+}
+
+
+void print_lines(const char *text, size_t *lines, int from, int to, int length) {
+	const char *line, *stop;
+	size_t end;
+
+	for (; from < to; ++from) {
+		line = text + lines[from];
+		end = lines[from + 1] - lines[from];
+		if ((stop = memchr(line, '\n', end)) != NULL) end = stop - line;
+		if ((stop = memchr(line, '\r', end)) != NULL) end = stop - line; /* anything after a CR is not shown */
+		if (length >= 0 && end > (size_t)length) end = length;
+		out(line, end);
+		out("\n", 1);
+	}
+}
+
+
+/* returns the line containing `offset` */
+int find_line(size_t *lines, int count, size_t offset) {
+	int low = 0, high = count - 1, mid;
+	while (low < high) {
+		mid = (low + high + 1) / 2;
+		if (lines[mid] <= offset) low = mid;
+		else high = mid - 1;
+	}
+	return low;
+}
+
+
+void init_text(Text *text, Transfer *t, const char *data, size_t length) {
+	text->t = t;
+	init_buffer(&text->buf);
+	text->fd = -1;
+	text->map = NULL;
+	text->map_length = 0;
+	text->data = data;
+	text->length = length;
+	text->lines = NULL;
+	text->count = text->capacity = 0;
+	text->ended = text->complete = t == NULL;
+}
+
+
+void free_text(Text *text) {
+	if (text->t) free_transfer(text->t);
+	if (text->map) munmap(text->map, text->map_length);
+	if (text->fd != -1) close(text->fd);
+	free_buffer(&text->buf);
+	free(text->lines);
+}
+
+
+/* catches up with the transfer and indexes the lines received so far */
+void update_text(Text *text) {
+	Transfer *t = text->t;
+	const char *p, *end, *stop;
+	int fd;
+
+	if (t && t->state >= DONE) { /* take over what has been received */
+		text->ended = 1;
+		text->complete = t->state == DONE;
+		text->buf = t->buf;
+		init_buffer(&t->buf);
+		text->fd = t->temp;
+		t->temp = -1;
+		text->length = t->received;
+		free_transfer(t);
+		text->t = t = NULL;
+	} else if (t) text->length = t->temp != -1 ? t->received : t->buf.length;
+
+	if ((fd = t ? t->temp : text->fd) != -1) {
+		if (text->map_length < text->length) {
+			/* map more than is there, so the mapping doesn't change with every chunk */
+			if (text->map) munmap(text->map, text->map_length);
+			text->map_length = text->length > text->map_length * 2 ? text->length : text->map_length * 2;
+			if ((text->map = mmap(NULL, text->map_length, PROT_READ, MAP_SHARED, fd, 0)) == MAP_FAILED) panic("cannot map text: %s", strerror(errno));
+		}
+		text->data = text->map;
+	} else if (t || text->buf.data) text->data = t ? t->buf.data : text->buf.data;
+
+	if (text->capacity == 0) {
+		text->capacity = 1024;
+		if ((text->lines = malloc(text->capacity * sizeof(size_t))) == NULL) panic("cannot allocate line index");
+		text->lines[0] = 0;
+	}
+	if (text->data == NULL) return; /* nothing received yet */
+	for (p = text->data + text->lines[text->count], end = text->data + text->length; p < end; ) {
+		if ((stop = memchr(p, '\n', end - p)) == NULL) {
+			if (!text->ended) break; /* wait for the rest of the line */
+			stop = end - 1;
+		}
+		p = stop + 1;
+		while (p < end && *p == '\r') ++p; /* just skip CR so we can show empty lines */
+		if (text->count + 1 >= text->capacity) {
+			text->capacity *= 2;
+			if ((text->lines = realloc(text->lines, text->capacity * sizeof(size_t))) == NULL) panic("cannot allocate line index");
+		}
+		text->lines[++text->count] = p - text->data;
+	}
+}
+
+
+/* waits until the text has `count` lines or has ended */
+void wait_for_lines(Text *text, int count) {
+	update_text(text);
+	while (text->t && text->count < count && !interrupted) {
+		engine_poll(-1, -1);
+		update_text(text);
+	}
+}
+
+
+void page_text(Text *text) {
+	static char pattern[256] = "";
+	char hint[256], *line;
+	const char *p, *found;
+	int top, bottom, height, length;
+
+	height = get_terminal_height();
+	length = get_var_integer("LINE_LENGTH", 128);
+	if (height < 1) height = 1;
+
+	if (!get_var_boolean("PAGE_TEXT")) {
+		/* show the lines as they arrive */
+		for (top = 0;; top = bottom) {
+			wait_for_lines(text, top + 1);
+			print_lines(text->data, text->lines, top, bottom = text->count, length);
+			flush_screen();
+			if (!text->t || interrupted) break;
+		}
+		return;
+	}
+
+	wait_for_lines(text, height + 1);
+	if (text->ended && text->count <= height) {
+		print_lines(text->data, text->lines, 0, text->count, length);
+		flush_screen();
+		return;
+	}
+
+	for (top = 0;;) {
+		wait_for_lines(text, top + height);
+		if (interrupted) break;
+		bottom = top + height < text->count ? top + height : text->count;
+		print_lines(text->data, text->lines, top, bottom, length);
+		snprintf(hint, sizeof(hint), "-- lines %d-%d of %d%s (RETURN, b(ack), <line>, /<search>, n(ext) or q(uit)) --",
+			top + 1, bottom, text->count, text->ended ? "" : "+");
+		if ((line = read_pager(hint)) == NULL || line[0] == 'q' || line[0] == 'Q') break;
+		update_text(text);
+
+		if (line[0] == '\0') {
+			if (text->ended && top + height >= text->count) break; /* RETURN at the end leaves the pager */
+			top += height;
+		} else if (line[0] == 'b' || line[0] == 'B') {
+			top = top > height ? top - height : 0;
+		} else if (isdigit((unsigned char)line[0])) {
+			top = atoi(line) - 1;
+			wait_for_lines(text, top + 1);
+		} else if (line[0] == '/' || line[0] == 'n' || line[0] == 'N') {
+			if (line[0] == '/' && line[1]) snprintf(pattern, sizeof(pattern), "%s", line + 1);
+			/* search what has arrived so far, from the line after the top one, so `n` finds the next match */
+			p = text->data + text->lines[top + 1 < text->count ? top + 1 : top];
+			if (!pattern[0]) error("no search pattern given");
+			else {
+				if ((found = memmem(p, text->data + text->lines[text->count] - p, pattern, strlen(pattern))) == NULL) {
+					found = memmem(text->data, text->lines[text->count], pattern, strlen(pattern)); /* wrap around */
+				}
+				if (found) top = find_line(text->lines, text->count, found - text->data);
+				else error("`%s` not found", pattern);
+			}
+		}
+		if (top > text->count - 1) top = text->count - 1;
+		if (top < 0) top = 0;
+	}
+	flush_screen();
+}
+
+
+void print_text(const char *data, size_t size) {
+	Text text;
+	init_text(&text, NULL, data, size);
+	page_text(&text);
+	free_text(&text);
+}
+
+
+const char *find_selector_handler(char type) {
+	static const char *handlers[256];
+	static int generation = -1;
+
+	/* rebuild the lookup table only after a type handler has been changed */
+	if (generation != typehandlers.generation) {
+		Variable *var;
+		memset(handlers, 0, sizeof(handlers));
+		for (var = typehandlers.list; var; var = var->next) {
+			if (var->name[0] == '\0' || var->name[1] != '\0') continue;
+			handlers[tolower((unsigned char)var->name[0])] = var->data; /* names are case insensitive */
+			handlers[toupper((unsigned char)var->name[0])] = var->data;
+		}
+		generation = typehandlers.generation;
+	}
+	return handlers[(unsigned char)type];
+}
+
+
+int match_selector(Selector *sel, const char *filter, size_t length) {
+	return str_contains_lower(sel->name, filter, length) || str_contains_lower(sel->path, filter, length);
+}
+
+
+const Matches *match_selectors(const SelectorList *list, const char *filter) {
+	char lower[256];
+	size_t length = strlen(str_lower(lower, sizeof(lower), filter));
+	int i, n;
+
+	if (matches.list == list && matches.generation == list->generation && matches.count == list->count && strstr(lower, matches.filter)) {
+		/* the filter got narrowed, so only the previous matches can still match */
+		for (i = 0, n = 0; i < matches.length; ++i) {
+			if (match_selector(&list->items[matches.items[i]], lower, length)) matches.items[n++] = matches.items[i];
+		}
+		matches.length = n;
+	} else {
+		if (list->count > matches.capacity) {
+			matches.capacity = list->count;
+			if ((matches.items = realloc(matches.items, matches.capacity * sizeof(int))) == NULL) panic("cannot allocate matches");
+		}
+		for (i = 0, n = 0; i < list->count; ++i) {
+			if (match_selector(&list->items[i], lower, length)) matches.items[n++] = i;
+		}
+		matches.length = n;
+	}
+	matches.list = list;
+	matches.generation = list->generation;
+	matches.count = list->count;
+	snprintf(matches.filter, sizeof(matches.filter), "%s", lower);
+	return &matches;
+}
+
+
+void print_menu(SelectorList *list, const char *filter, Transfer *t) {
+	const Matches *found = filter ? match_selectors(list, filter) : NULL;
+	int i, n, k, count, height, pages, length;
+	long wait, deadline;
+	long long mark = now_us(), busy = 0; /* the time spent waiting doesn't count as rendering */
+	Selector *sel;
+
+	height = get_terminal_height();
+	pages = get_var_boolean("PAGE_TEXT");
+	length = get_var_integer("LINE_LENGTH", 128);
+	wait = get_var_integer("WAIT_TIME", 3) * 1000L;
+	deadline = now_ms() + wait;
+
+	for (i = 0, n = 0;; ++n) {
+		/* keep receiving until the menu has grown past `n`, the transfer is done or we waited long enough */
+		if (t) while (n >= list->count && t->state < DONE && !interrupted && now_ms() < deadline) {
+			flush_screen(); /* show what we have got so far */
+			busy += now_us() - mark;
+			engine_poll(-1, deadline - now_ms());
+			mark = now_us();
+		}
+		count = found ? found->length : list->count;
+		if (n >= count) break;
+
+		k = list->reverse ? count - n - 1 : n;
+		sel = &list->items[found ? found->items[k] : k];
+		switch (sel->type) {
+			case 'i': out_string("     | "); out_text(NULL, sel->name, length); break;
+			case '3': out_string("     | "); out_text(esc_error, sel->name, length); break;
+			default:
+				out_index(sel->index);
+				if (strchr("145679", sel->type) || find_selector_handler(sel->type)) {
+					out_text(esc_link, sel->name, length);
+				} else {
+					out_text(esc_item, sel->name, length);
+				}
+				break;
+		}
+		if (pages && ++i >= height) {
+			busy += now_us() - mark;
+			if (show_pager_stop()) { mark = now_us(); break; }
+			mark = now_us();
+			i = 0;
+			deadline = now_ms() + wait; /* the time at the pager doesn't count */
+		}
+	}
+	flush_screen();
+	stats.render_time += busy + now_us() - mark;
+	++stats.rendered;
+}
+
+
+/*============================================================================*/
+Transfer *find_prefetch(const char *key) {
+	char buffer[1024];
+	Transfer *t;
+
+	for (t = transfers; t; t = t->next) {
+		if (t->data != &prefetch) continue;
+		if (key == NULL || !strcmp(cache_key(buffer, sizeof(buffer), &t->sel, NULL), key)) return t;
+	}
+	return NULL;
+}
+
+
+void prefetch_done(Transfer *t) {
+	char key[1024];
+	SelectorList list;
+
+	if (t->state == DONE) {
+		cache_key(key, sizeof(key), &t->sel, NULL); /* search selectors are never prefetched */
+		disk_cache_put(key, t->buf.data, t->buf.length);
+		if (t->sel.type == '1') {
+			parse_selector_list(&list, t->buf.data, t->buf.length);
+			cache_put(key, &list);
+			free_selector_list(&list);
+		}
+	}
+	queue_done(t);
+}
+
+
+Transfer *start_prefetch(Queue *queue, Selector *sel) {
+	(void)queue;
+	return new_transfer(sel, NULL, NULL, -1, prefetch_done);
+}
+
+
+void wait_for_prefetch(const char *key) {
+	/* it is already on the way, so don't request it twice */
+	while (find_prefetch(key) && !interrupted) engine_poll(-1, -1);
+}
+
+
+void prefetch_menu(SelectorList *list) {
+	char key[1024];
+	Selector *sel, copy;
+	int i, depth, type0;
+
+	free_queue(&prefetch);
+	if (!get_var_boolean("PREFETCH")) return;
+	depth = get_var_integer("PREFETCH_DEPTH", 5);
+	/* text is only cached on disk, and a handler wouldn't look at the cache anyway */
+	type0 = disk_cache_enabled() && find_selector_handler('0') == NULL;
+
+	/* don't hammer the servers, we might never look at any of these */
+	init_queue(&prefetch, 4, 2, start_prefetch);
+	for (i = 0; i < list->count && prefetch.list.count < depth; ++i) {
+		sel = &list->items[list->reverse ? list->count - i - 1 : i];
+		if (sel->type != '1' && (sel->type != '0' || !type0)) continue;
+		cache_key(key, sizeof(key), sel, NULL);
+		if (cache_fresh(key) || disk_cache_fresh(key)) continue;
+		copy_selector(&copy, sel);
+		append_selector(&prefetch.list, &copy);
+	}
+	start_queue(&prefetch);
+}
+
+
+/*============================================================================*/
+void enter_menu(Selector *to, SelectorList *list, int add_to_history) {
+	index_menu(to, list);
+	if (add_to_history) {
+		Selector sel;
+		copy_selector(&sel, to);
+		write_record(&history_log, '+', &sel);
+		visit_selector(&sel);
+	}
+	free_selector_list(&menu);
+	menu = *list;
+	prefetch_menu(&menu);
+}
+
+
+void free_navigation(Navigation *nav) {
+	if (nav == NULL) return;
+	free_selector(&nav->to);
+	free_selector_list(&nav->list);
+	free(nav);
+}
+
+
+void enter_navigation(Navigation *nav) {
+	cache_put(nav->key, &nav->list);
+	enter_menu(&nav->to, &nav->list, nav->add_to_history);
+	init_selector_list(&nav->list, 0);
+	free_navigation(nav);
+}
+
+
+void finish_navigation(Transfer *t, int foreground) {
+	Navigation *nav = t->data;
+	Buffer buf;
+
+	t->data = NULL;
+	if (t->state == DONE) disk_cache_put(nav->key, t->buf.data, t->buf.length);
+	if (nav->list.count == 0 && !interrupted && disk_cache_get(nav->key, &buf, 1)) {
+		free_selector_list(&nav->list);
+		parse_selector_list(&nav->list, buf.data, buf.length);
+		free_buffer(&buf);
+		notify(esc_info, "showing cached copy of `%s`", print_selector(&nav->to, 1));
+		if (foreground) print_menu(&nav->list, NULL, NULL);
+	}
+
+	if (nav->list.count == 0 || interrupted) {
+		if (!foreground) notify(esc_error, "cannot load `%s`", print_selector(&nav->to, 1));
+		free_navigation(nav);
+	} else if (foreground || at_prompt) {
+		if (!foreground) notify(esc_info, "`%s` is loaded, type `show` to see it", print_selector(&nav->to, 1));
+		enter_navigation(nav);
+	} else {
+		/* a command might still use the current menu, so wait for the prompt */
+		free_navigation(arrived);
+		arrived = nav;
+	}
+}
+
+
+void loading_done(Transfer *t) {
+	loading = NULL;
+	finish_navigation(t, 0);
+}
+
+
+void cancel_loading() {
+	free_navigation(arrived);
+	arrived = NULL;
+	if (loading == NULL) return;
+	free_navigation(loading->data);
+	free_transfer(loading);
+	loading = NULL;
+}
+
+
+void load_menu(Selector *to, const char *query, const char *key) {
+	Navigation *nav;
+	Transfer *t;
+	Buffer buf;
+	int add_to_history = to != last_selector(&history);
+
+	if (disk_cache_get(key, &buf, 0)) {
+		SelectorList list;
+		parse_selector_list(&list, buf.data, buf.length);
+		free_buffer(&buf);
+		print_menu(&list, NULL, NULL);
+		if (list.count == 0) free_selector_list(&list);
+		else {
+			cache_put(key, &list);
+			enter_menu(to, &list, add_to_history);
+		}
+		return;
+	}
+
+	if ((nav = malloc(sizeof(Navigation))) == NULL) panic("cannot allocate navigation");
+	copy_selector(&nav->to, to);
+	snprintf(nav->key, sizeof(nav->key), "%s", key);
+	init_parser(&nav->parser, &nav->list);
+	nav->add_to_history = add_to_history;
+	t = new_transfer(to, query, &nav->parser, -1, NULL);
+	t->data = nav;
+
+	/* show the menu while it is still arriving */
+	print_menu(&nav->list, NULL, t);
+	if (t->state < DONE && !interrupted) {
+		/* the server is slow or the pager was left, so the shell can be used until the rest arrived */
+		t->finish = loading_done;
+		t->quiet = 1;
+		loading = t;
+		info("`%s` is still loading in the background (press CTRL-C to cancel)", print_selector(to, 1));
+		return;
+	}
+	if (t->state < DONE) fail_transfer(t, "cancelled `%s`", print_selector(to, 1));
+	finish_navigation(t, 1);
+	free_transfer(t);
 }
 
 
-/*============================================================================*/
-const char *find_selector_handler(char type) {
-	char name[2] = { type, 0 };
-	return set_var(&typehandlers, name, NULL);
-}
-
+/* replaces the stale search results, unless we went somewhere else meanwhile */
+void refresh_done(Transfer *t) {
+	Navigation *nav = t->data;
 
-void print_menu(Selector *list, const char *filter) {
-	int i, height, pages, length;
+	t->data = NULL;
+	if (t->state != DONE || nav->list.count == 0) {
+		free_navigation(nav);
+		return;
+	}
+	disk_cache_put(nav->key, t->buf.data, t->buf.length);
+	if (menu.generation != nav->generation) {
+		cache_put(nav->key, &nav->list);
+		free_navigation(nav);
+	} else if (at_prompt) {
+		notify(esc_info, "`%s` is refreshed, type `show` to see it", print_selector(&nav->to, 1));
+		enter_navigation(nav);
+	} else {
+		/* a command might still use the current menu, so wait for the prompt */
+		free_navigation(arrived);
+		arrived = nav;
+	}
+}
 
-	height = get_terminal_height();
-	pages = get_var_boolean("PAGE_TEXT");
-	length = get_var_integer("LINE_LENGTH", 128);
 
-	for (i = 0; list; list = list->next) {
-		if (filter && !str_contains(list->name, filter) && !str_contains(list->path, filter)) continue;
-		switch (list->type) {
-			case 'i': printf("     | %.*s\n", length, list->name); break;
-			case '3': printf("     | \33[31m%.*s\33[0m\n", length, list->name); break;
-			default:
-				if (strchr("145679", list->type) || find_selector_handler(list->type)) {
-					printf("%4d | \33[4;36m%.*s\33[0m\n", list->index, length, list->name);
-				} else {
-					printf("%4d | \33[0;36m%.*s\33[0m\n", list->index, length, list->name);
-				}
-				break;
+/* shows stale search results right away and refreshes them in the background */
+int revalidate_search(Selector *to, const char *query, const char *key) {
+	SelectorList list;
+	Navigation *nav;
+	Transfer *t;
+	Buffer buf;
+	int add_to_history = to != last_selector(&history);
+
+	if (!cache_get(key, &list, 1)) {
+		if (!disk_cache_get(key, &buf, 1)) return 0;
+		parse_selector_list(&list, buf.data, buf.length);
+		free_buffer(&buf);
+		if (list.count == 0) {
+			free_selector_list(&list);
+			return 0;
 		}
-		if (pages && ++i >= height) { if (show_pager_stop()) break; i = 0; }
 	}
+	/* `to` may point into the history or the menu, entering the menu moves or frees it */
+	if ((nav = malloc(sizeof(Navigation))) == NULL) panic("cannot allocate navigation");
+	copy_selector(&nav->to, to);
+	snprintf(nav->key, sizeof(nav->key), "%s", key);
+	init_parser(&nav->parser, &nav->list);
+	nav->add_to_history = 0;
+
+	info("showing cached copy of `%s`, it is refreshed in the background", print_selector(&nav->to, 1));
+	print_menu(&list, NULL, NULL);
+	enter_menu(&nav->to, &list, add_to_history);
+	nav->generation = menu.generation;
+
+	for (t = transfers; t; t = t->next) {
+		if (t->finish == refresh_done && !strcmp(((Navigation*)t->data)->key, key)) {
+			free_navigation(nav); /* already on the way */
+			return 1;
+		}
+	}
+	t = new_transfer(&nav->to, query, &nav->parser, -1, refresh_done);
+	t->data = nav;
+	return 1;
 }
 
 
+/*============================================================================*/
 void execute_handler(const char *handler, Selector *to) {
 	char command[1024], *filename = NULL;
+	int streamed = 0;
 	size_t l;
 
 	for (l = 0; *handler && l < sizeof(command) - 1; ) {
@@ -574,6 +3865,7 @@ void execute_handler(const char *handler, Selector *to) {
 					if (filename == NULL) return;
 					append = filename;
 					break;
+				case '|': streamed = 1; break;
 			}
 			handler += 2;
 			while (*append && l < sizeof(command) - 1) command[l++] = *append++;
@@ -581,26 +3873,67 @@ void execute_handler(const char *handler, Selector *to) {
 	}
 	command[l] = '\0';
 
-	if (system(command) == -1) error("could not execute `%s`", command);
+	if (streamed) download_to_command(to, command);
+	else if (system(command) == -1) error("could not execute `%s`", command);
 	if (filename) remove(filename);
 }
 
 
+/* pages a text while it is still downloading, memory beyond MAX_MEMORY spills into a temporary file */
+void show_text(Selector *to) {
+	char key[1024];
+	Buffer buf;
+	Text text;
+	int failed;
+
+	cache_key(key, sizeof(key), to, NULL);
+	wait_for_prefetch(key);
+	init_buffer(&buf);
+	if (disk_cache_get(key, &buf, 0)) {
+		index_text(to, buf.data, buf.length);
+		print_text(buf.data, buf.length);
+		free_buffer(&buf);
+		return;
+	}
+
+	init_text(&text, new_transfer(to, NULL, NULL, -1, NULL), NULL, 0);
+	text.t->spill_at = (size_t)get_var_integer("MAX_MEMORY", 65536) * 1024;
+	page_text(&text);
+	update_text(&text); /* it might have ended while we left the pager */
+	if (text.complete) {
+		disk_cache_put(key, text.data, text.length);
+		index_text(to, text.data, text.length);
+	}
+	failed = text.ended && !text.complete && text.length == 0;
+	free_text(&text); /* cancels the transfer when the pager was left early */
+
+	if (failed && !interrupted && disk_cache_get(key, &buf, 1)) {
+		info("showing cached copy of `%s`", print_selector(to, 1));
+		print_text(buf.data, buf.length);
+		free_buffer(&buf);
+	}
+}
+
+
 void navigate(Selector *to) {
 	const char *query = NULL, *handler;
 
 	if (to == NULL) return;
 	switch (to->type) {
 		case '7': /* gopher full-text search */
-			query = read_line("enter gopher search string: ");
+			if ((query = read_line("enter gopher search string: ")) == NULL) break;
 			/* fallthrough */
 		case '1': { /* gopher submenu */
-			Selector *new = download_to_menu(to, query);
-			if (new == NULL) break;
-			if (history != to) history = prepend_selector(history, copy_selector(to));
-			free_selector(menu);
-			print_menu(new, NULL);
-			menu = new;
+			char key[1024];
+			SelectorList new;
+			cancel_loading(); /* we are going somewhere else now */
+			cache_key(key, sizeof(key), to, query);
+			wait_for_prefetch(key);
+			if (query && !cache_fresh(key) && !disk_cache_fresh(key) && revalidate_search(to, query, key)) break;
+			if (cache_get(key, &new, 0)) {
+				print_menu(&new, NULL, NULL);
+				enter_menu(to, &new, to != last_selector(&history));
+			} else load_menu(to, query, key);
 			break;
 		}
 		case '4': case '5': case '6': case '9': /* binary files */
@@ -612,9 +3945,7 @@ void navigate(Selector *to) {
 			if ((handler = find_selector_handler(to->type)) != NULL) {
 				execute_handler(handler, to);
 			} else if (to->type == '0') { /* type 0 can be paged internally */
-				char *text = download(to, NULL, NULL);
-				print_text(text);
-				if (text != NULL) free(text);
+				show_text(to);
 			} else {
 				error("no handler for type `%c`", to->type);
 			}
@@ -623,7 +3954,7 @@ void navigate(Selector *to) {
 }
 
 
-void edit_variable(Variable **vars, char *line) {
+void edit_variable(Table *vars, char *line) {
 	char *name = next_token(&line);
 	char *data = next_token(&line);
 
@@ -632,7 +3963,7 @@ void edit_variable(Variable **vars, char *line) {
 		else puts(set_var(vars, name, NULL));
 	} else {
 		Variable *it;
-		for (it = *vars; it; it = it->next) printf("%s = \"%s\"\n", it->name, it->data);
+		for (it = vars->list; it; it = it->next) printf("%s = \"%s\"\n", it->name, it->data);
 	}
 }
 
@@ -665,6 +3996,25 @@ static const Help gopher_help[] = {
 		"Description:\n" \
 		"\tGo back in history.\n" \
 	},
+	{
+		"batch",
+		"Syntax:\n" \
+		"\tdelve -b [-c config-file] [file...]\n" \
+		"\n" \
+		"Description:\n" \
+		"\tReads URLs and commands from the files or stdin, one per line,\n" \
+		"\tthere is no prompt, pager or color. The URLs are fetched side by\n" \
+		"\tside (MAX_DOWNLOADS and MAX_HOST_DOWNLOADS) and the responses are\n" \
+		"\twritten to stdout in the order of the input. When BATCH_DIRECTORY\n" \
+		"\tis set, they are saved into <directory>/<host>[:<port>]/<path>\n" \
+		"\tinstead and stdout gets a line for every URL: `ok` or `failed`,\n" \
+		"\tbytes, file and URL separated by tabs. A command runs once\n" \
+		"\teverything before it has been written. Errors go to stderr and\n" \
+		"\tthe exit status is 1 if anything failed.\n" \
+		"\n" \
+		"Examples:\n" \
+		"\techo gopher.floodgap.com/0/gopher/proxy | delve -b\n" \
+	},
 	{
 		"bookmarks",
 		"Syntax:\n" \
@@ -681,13 +4031,33 @@ static const Help gopher_help[] = {
 		"\n" \
 		"Description:\n" \
 		"\tDefine a new bookmark with the given <name> and <url>.\n" \
+		"\tBookmarks defined at the prompt are kept in the DATA_DIRECTORY\n" \
+		"\tfor the next sessions.\n" \
 	},
 	{
 		"commands",
 		"available commands\n" \
-		"alias         back          bookmarks     help          history\n" \
-		"open          quit          save          see           set\n" \
-		"show          type\n" \
+		"alias         back          bookmarks     find          help\n" \
+		"history       mirror        open          quit          save\n" \
+		"see           set           show          stats         type\n" \
+	},
+	{
+		"find",
+		"Syntax:\n" \
+		"\tFIND <terms>\n" \
+		"\n" \
+		"Description:\n" \
+		"\tSearch everything visited so far, also in earlier sessions.\n" \
+		"\tMenus are found by their titles and info lines, texts by their\n" \
+		"\tcontents and the links of visited menus by their names. Only\n" \
+		"\tselectors containing all <terms> are shown, best matches first.\n" \
+		"\tThe result becomes the current menu, so the items can be opened\n" \
+		"\tright away. The index is kept in the CACHE_DIRECTORY and needs\n" \
+		"\tthe disk cache.\n" \
+		"\n" \
+		"Examples:\n" \
+		"\tfind gopher # all selectors mentioning gopher\n" \
+		"\tfind phlog 2019 # selectors with both words\n" \
 	},
 	{
 		"help",
@@ -706,7 +4076,10 @@ static const Help gopher_help[] = {
 		"\tShow the gopher history. If a <filter> is specified, it will\n" \
 		"\tshow all selectors containing the <filter> in name or path.\n" \
 		"\tIf <item-id> is specified, navigate to the given <item-id>\n" \
-		"\tfrom history.\n" \
+		"\tfrom history. A selector is listed only once, visiting it again\n" \
+		"\tmoves it to the top. The oldest selectors are dropped beyond\n" \
+		"\tHISTORY_SIZE. The history is kept in the DATA_DIRECTORY for the\n" \
+		"\tnext sessions.\n" \
 	},
 	{
 		"license",
@@ -726,6 +4099,18 @@ static const Help gopher_help[] = {
 		"You should have received a copy of the GNU General Public License\n" \
 		"along with this program.  If not, see <https://www.gnu.org/licenses/>.\n" \
 	},
+	{
+		"mirror",
+		"Syntax:\n" \
+		"\tMIRROR <url> <directory> [<depth>]\n" \
+		"\n" \
+		"Description:\n" \
+		"\tCopies the gopher menu <url> with all menus, texts and binaries\n" \
+		"\tfrom the same host into <directory>, following menus until <depth>\n" \
+		"\t(default 3). Menus are stored as `gophermap` files. Already saved\n" \
+		"\tfiles and cached menus are not downloaded again.\n" \
+		"\tMAX_DOWNLOADS and MAX_HOST_DOWNLOADS limit the concurrent downloads.\n" \
+	},
 	{
 		"open",
 		"Syntax:\n" \
@@ -746,10 +4131,15 @@ static const Help gopher_help[] = {
 		"save",
 		"Syntax:\n" \
 		"\tSAVE <item-id>\n" \
+		"\tSAVE <item-id>-<item-id>[,<item-id>...]\n" \
+		"\tSAVE * [filter]\n" \
 		"\n" \
 		"Description:\n" \
 		"\tSaves the given <item-id> from the menu to the disk.\n" \
 		"\tYou will be asked for a filename.\n" \
+		"\tA list of items or `*` saves several items at once into the\n" \
+		"\tDOWNLOAD_DIRECTORY, `*` takes an optional filter like SHOW.\n" \
+		"\tMAX_DOWNLOADS and MAX_HOST_DOWNLOADS limit the concurrent downloads.\n" \
 	},
 	{
 		"see",
@@ -779,6 +4169,19 @@ static const Help gopher_help[] = {
 		"\tShow the current gopher menu. If a <filter> is specified, it will\n" \
 		"\tshow all selectors containing the <filter> in name or path.\n"
 	},
+	{
+		"stats",
+		"Syntax:\n" \
+		"\tSTATS\n" \
+		"\n" \
+		"Description:\n" \
+		"\tShow how many requests were made, how long parsing and showing\n" \
+		"\tmenus took and how often the caches were hit. For the last 256\n" \
+		"\trequests the times of every host are shown: resolving the name,\n" \
+		"\tconnecting, waiting for the first byte and the total, each as\n" \
+		"\tmedian and 90th percentile. Use `set TRACE on` to see the times\n" \
+		"\tof every request when it is done.\n" \
+	},
 	{
 		"type",
 		"Syntax:\n" \
@@ -791,6 +4194,7 @@ static const Help gopher_help[] = {
 		"\n" \
 		"Examples:\n" \
 		"\ttype 0 \"less %f\" # create a type handler for gopher texts\n" \
+		"\ttype 0 \"less %|\" # show them while they are downloaded\n" \
 		"\n" \
 		"Format string:\n" \
 		"\tThe <value> for type handlers can have the following formating options:\n" \
@@ -800,14 +4204,51 @@ static const Help gopher_help[] = {
 		"\t%s - selector\n" \
 		"\t%n - name\n"
 		"\t%f - filename (downloaded to a temporary file prior to execution)\n" \
+		"\t%| - nothing, the handler reads the content from its stdin while\n" \
+		"\t     it is downloaded\n" \
 	},
 	{
 		"variables",
 		"Following variables are used by delve:\n" \
 		"\tHOME_HOLE - the gopher URL which will be opened on startup\n" \
 		"\tDOWNLOAD_DIRECTORY - the directory which will be default for downloads\n" \
+		"\tBATCH_DIRECTORY - where `delve -b` saves the responses (empty writes them to stdout)\n" \
 		"\tPAGE_TEXT - when `on` or `true` menus & text will be paged\n" \
+		"\t\ttexts can be paged back with `b`, a line number jumps to\n" \
+		"\t\tthat line and `/<text>` or `n` search for a text\n" \
 		"\tLINE_LENGTH - defines how long a menu/text line will be displayed\n" \
+		"\tMAX_MEMORY - kilobytes of a text kept in memory, the rest goes to a\n" \
+		"\t\ttemporary file (default 65536)\n" \
+		"\tCACHE_SIZE - kilobytes of parsed menus kept in memory (0 disables)\n" \
+		"\tCACHE_TTL - seconds a cached menu stays valid (negative never expires)\n" \
+		"\tCACHE_DIRECTORY - where responses are cached on disk (empty disables)\n" \
+		"\tDISK_CACHE_SIZE - kilobytes of responses kept on disk (0 disables)\n" \
+		"\tDISK_CACHE_TTL - seconds a response on disk stays valid\n" \
+		"\tSEARCH_TTL - seconds cached search results stay valid, older ones are\n" \
+		"\t\tshown while they are refreshed in the background (default 3600)\n" \
+		"\tDATA_DIRECTORY - where history and bookmarks are kept (empty disables)\n" \
+		"\tHISTORY_SIZE - number of selectors kept in the history\n" \
+		"\tDNS_TTL - seconds a resolved hostname is remembered\n" \
+		"\tCONNECT_TIMEOUT - seconds to wait for a connection\n" \
+		"\tREAD_TIMEOUT - seconds to wait for data from a server (0 disables)\n" \
+		"\tRECV_BUFFER - kilobytes of the socket receive buffer (0 leaves it to the system)\n" \
+		"\tTCP_NODELAY - when `on` or `true` requests are sent without delay\n" \
+		"\tTCP_QUICKACK - when `on` or `true` received data is acknowledged at once (Linux)\n" \
+		"\tTCP_FASTOPEN - when `on` or `true` requests to addresses we connected to before\n" \
+		"\t\tgo out with the SYN and save a round trip (Linux)\n" \
+		"\tTLS - `on` connects with TLS, `auto` falls back to plain text for hosts\n" \
+		"\t\twhich don't speak it, the sessions are kept in the CACHE_DIRECTORY\n" \
+		"\t\tto resume them (needs a build with DELVE_USE_TLS)\n" \
+		"\tTLS_VERIFY - when `off` or `false` certificates are not verified\n" \
+		"\tTLS_TIMEOUT - seconds to wait for the TLS handshake (default 3)\n" \
+		"\tMAX_DOWNLOADS - concurrent downloads of SAVE and MIRROR (default 8)\n" \
+		"\tMAX_HOST_DOWNLOADS - concurrent downloads from one host (default 4)\n" \
+		"\tWAIT_TIME - seconds to wait for a menu before it loads in the background\n" \
+		"\tPREFETCH - fetch the menus and texts of the current menu in the background\n" \
+		"\tPREFETCH_DEPTH - how many selectors of a menu are prefetched (default 5)\n" \
+		"\tTRACE - when `on` or `true` the times of every request are shown\n" \
+		"\tFIND_RESULTS - how many selectors FIND shows at most (default 100)\n" \
+		"\tINDEX_TEXT_SIZE - kilobytes of a text which are indexed for FIND\n" \
 	},
 	{ NULL, NULL }
 };
@@ -821,31 +4262,63 @@ static void cmd_quit(char *line) {
 
 
 static void cmd_open(char *line) {
-	Selector *to = parse_selector(next_token(&line));
-	navigate(to);
-	free_selector(to);
+	Selector to;
+	if (parse_selector(&to, next_token(&line)) == NULL) return;
+	navigate(&to);
+	free_selector(&to);
+}
+
+
+static void cmd_mirror(char *line) {
+	Selector to;
+	char *directory, *depth;
+
+	if (parse_selector(&to, next_token(&line)) == NULL) return;
+	if ((directory = next_token(&line)) == NULL) error("no directory given");
+	else if (to.type != '1') error("can only mirror gopher menus");
+	else {
+		depth = next_token(&line);
+		mirror(&to, directory, depth ? atoi(depth) : 3);
+	}
+	free_selector(&to);
+}
+
+
+static void cmd_find(char *line) {
+	SelectorList results;
+
+	line = str_skip(line, " \t\v");
+	if (!*line) error("no search terms given");
+	else if (!disk_cache_enabled()) error("the search index is kept in the disk cache, which is disabled");
+	else if (!find_documents(line, &results)) error("nothing found for `%s`", line);
+	else {
+		print_menu(&results, NULL, NULL);
+		free_selector_list(&menu);
+		menu = results;
+	}
 }
 
 
 static void cmd_show(char *line) {
-	print_menu(menu, next_token(&line));
+	print_menu(&menu, next_token(&line), NULL);
 }
 
 
 static void cmd_save(char *line) {
-	Selector *to = find_selector(menu, line);
-	if (to) download_to_file(to);
+	Selector *to;
+	line = str_skip(line, " \t\v");
+	if (strpbrk(line, "-,*")) download_many(line);
+	else if ((to = find_selector(&menu, line)) != NULL) download_to_file(to);
 }
 
 
 static void cmd_back(char *line) {
-	Selector *to = history ? history->next : NULL;
 	(void)line;
-	if (to != NULL) {
-		history->next = NULL;
-		free_selector(history);
-		history = to;
-		navigate(to);
+	if (history.count > 1) {
+		free_selector(&history.items[--history.count]);
+		history.generation = ++list_generation;
+		write_record(&history_log, '-', NULL);
+		navigate(last_selector(&history));
 	} else {
 		error("history empty");
 	}
@@ -860,7 +4333,7 @@ static void cmd_help(char *line) {
 	if (topic) {
 		for (help = gopher_help; help->name; ++help) {
 			if (!strcasecmp(help->name, topic)) {
-				if (help->text) print_text(help->text);
+				if (help->text) print_text(help->text, strlen(help->text));
 				else printf("sorry topic `%s` has no text yet :(\n", topic);
 				return;
 			}
@@ -877,27 +4350,87 @@ static void cmd_help(char *line) {
 
 
 static void cmd_history(char *line) {
-	Selector *to = find_selector(history, line);
+	Selector *to = find_selector(&history, line);
 	if (to != NULL) navigate(to);
-	else print_menu(history, next_token(&line));
+	else print_menu(&history, next_token(&line), NULL);
 }
 
 
 static void cmd_bookmarks(char *line) {
-	Selector *to = find_selector(bookmarks, line);
+	Selector *to = find_selector(&bookmarks, line);
 	if (to != NULL) navigate(to);
 	else {
 		char *name = next_token(&line);
 		char *url = next_token(&line);
 		if (url) {
-			Selector *sel = parse_selector(url);
-			if (sel) {
-				str_free(sel->name);
-				sel->name = str_copy(name);
-				bookmarks = append_selector(bookmarks, sel);
+			Selector sel;
+			if (parse_selector(&sel, url)) {
+				str_free(sel.name);
+				sel.name = str_copy(name);
+				append_selector(&bookmarks, &sel);
+				write_record(&bookmarks_log, '+', &sel);
 			}
-		} else print_menu(bookmarks, name);
+		} else print_menu(&bookmarks, name, NULL);
+	}
+}
+
+
+int compare_longs(const void *a, const void *b) {
+	long x = *(const long*)a, y = *(const long*)b;
+	return x < y ? -1 : x > y;
+}
+
+
+double percentile(long *values, int count, int p) {
+	return count ? values[(count - 1) * p / 100] / 1000.0 : 0.0;
+}
+
+
+static void cmd_stats(char *line) {
+	const Sample *sample, *first;
+	long dns[256], connect[256], first_byte[256], total[256], transfer;
+	int i, j, n, requests, failed, count = stats.count < 256 ? stats.count : 256;
+	double bytes;
+
+	(void)line;
+	printf("%d requests, %.1f kb of menus parsed in %.1f ms, %d menus rendered in %.1f ms\n",
+		stats.count, stats.parsed / 1024.0, stats.parse_time / 1000.0, stats.rendered, stats.render_time / 1000.0);
+	printf("memory cache %d hits, %d misses, disk cache %d hits, %d misses\n",
+		stats.cache_hits, stats.cache_misses, stats.disk_hits, stats.disk_misses);
+#ifdef DELVE_USE_TLS
+	printf("tls %d handshakes, %d resumed\n", stats.handshakes, stats.resumed);
+#endif /* DELVE_USE_TLS */
+	if (count == 0) return;
+
+	printf("\n%-16s %5s %5s %9s %8s  %-11s %-11s %-11s %-11s\n", "last requests", "total", "fail", "kb", "kb/s", "dns", "connect", "first byte", "total");
+	printf("%-16s %5s %5s %9s %8s  %5s %5s %5s %5s %5s %5s %5s %5s\n", "", "", "", "", "", "p50", "p90", "p50", "p90", "p50", "p90", "p50", "p90");
+	for (i = 0; i < count; ++i) {
+		first = &stats.samples[i];
+		for (j = 0; j < i && stats.samples[j].host != first->host; ++j) ;
+		if (j < i) continue; /* the host was shown already */
+
+		for (n = requests = failed = 0, bytes = 0, transfer = 0, j = i; j < count; ++j) {
+			sample = &stats.samples[j];
+			if (sample->host != first->host) continue;
+			++requests;
+			bytes += sample->bytes;
+			if (sample->failed) { ++failed; continue; }
+			transfer += sample->transfer;
+			dns[n] = sample->dns;
+			connect[n] = sample->connect;
+			first_byte[n] = sample->first_byte;
+			total[n++] = sample->dns + sample->connect + sample->first_byte + sample->transfer;
+		}
+		qsort(dns, n, sizeof(long), compare_longs);
+		qsort(connect, n, sizeof(long), compare_longs);
+		qsort(first_byte, n, sizeof(long), compare_longs);
+		qsort(total, n, sizeof(long), compare_longs);
+		printf("%-16.16s %5d %5d %9.1f %8.1f  %5.1f %5.1f %5.1f %5.1f %5.1f %5.1f %5.1f %5.1f\n",
+			first->host, requests, failed, bytes / 1024.0, transfer > 0 ? bytes * 1000000.0 / 1024.0 / transfer : 0.0,
+			percentile(dns, n, 50), percentile(dns, n, 90), percentile(connect, n, 50), percentile(connect, n, 90),
+			percentile(first_byte, n, 50), percentile(first_byte, n, 90), percentile(total, n, 50), percentile(total, n, 90));
 	}
+	puts("(times in ms)");
 }
 
 
@@ -907,7 +4440,7 @@ static void cmd_set(char *line) {
 
 
 static void cmd_see(char *line) {
-	Selector *to = find_selector(menu, line);
+	Selector *to = find_selector(&menu, line);
 	if (to && !strchr("3i", to->type)) puts(print_selector(to, 1));
 }
 
@@ -924,6 +4457,9 @@ static void cmd_type(char *line) {
 
 static const Command gopher_commands[] = {
 	{ "quit", cmd_quit },
+	{ "mirror", cmd_mirror },
+	{ "find", cmd_find },
+	{ "stats", cmd_stats },
 	{ "open", cmd_open },
 	{ "show", cmd_show },
 	{ "save", cmd_save },
@@ -940,95 +4476,416 @@ static const Command gopher_commands[] = {
 
 
 /*============================================================================*/
-void eval(const char *input, const char *filename) {
-	static int nested =  0;
+/* commands are looked up by the hash of their lower case name */
+const Command *find_command(const char *name) {
+	char lower[64];
 	const Command *cmd;
-	char *str, *copy, *line, *token, *alias;
-	int line_no;
+	int *id;
 
-	if (nested >= 10) {
-		error("eval() nested too deeply");
-		return;
-	} else ++nested;
+	if (command_names.size == 0) {
+		for (cmd = gopher_commands; cmd->name; ++cmd) set_insert(&command_names, hash_string(cmd->name), cmd - gopher_commands);
+	}
+	if ((id = set_lookup(&command_names, hash_string(str_lower(lower, sizeof(lower), name)))) == NULL) return NULL;
+	return strcasecmp(gopher_commands[*id].name, name) ? NULL : &gopher_commands[*id];
+}
 
+
+/* splits the input into statements once, commands are resolved right away, aliases when they are used */
+Script *compile(const char *input) {
+	char *str, *copy, *line, *name;
+	Script *script;
+	Statement *st;
+	int line_no;
+
+	if ((script = calloc(1, sizeof(Script))) == NULL) panic("cannot allocate script");
 	str = copy = str_copy(input); /* copy input as it will be modified */
 
 	for (line_no = 1; (line = str_split(&str, "\r\n")) != NULL; ++line_no) {
-		if ((token = next_token(&line)) != NULL) {
-			for (cmd = gopher_commands; cmd->name; ++cmd) {
-				if (!strcasecmp(cmd->name, token)) {
-					cmd->func(line);
-					break;
-				}
-			}
-			if (cmd->name == NULL) {
-				if ((alias = set_var(&aliases, token, NULL)) != NULL) eval(alias, token);
-				else {
-					if (filename == NULL) error("unknown command `%s`", token);
-					else error("unknown command `%s` in file `%s` at line %d", token, filename, line_no);
-				}
+		line = str_skip(line, " \v\t");
+		/* a variable as command is looked up on every run, like the variables in the arguments */
+		if (*line == '$') name = str_split(&line, " \v\t");
+		else name = next_token(&line);
+		if (name != NULL) {
+			if (script->count == script->capacity) {
+				script->capacity = script->capacity ? script->capacity * 2 : 8;
+				if ((script->statements = realloc(script->statements, script->capacity * sizeof(Statement))) == NULL) panic("cannot allocate script");
 			}
+			st = &script->statements[script->count++];
+			st->cmd = *name == '$' ? NULL : find_command(name);
+			st->name = str_copy(name);
+			st->args = str_copy(line ? line : "");
+			st->line_no = line_no;
 		}
 		str = str_skip(str, "\r\n");
 	}
 
 	str_free(copy);
+	return script;
+}
+
+
+Script *alias_script(Variable *alias) {
+	if (alias->script == NULL) alias->script = compile(alias->data);
+	return alias->script;
+}
+
+
+void run_script(Script *script, const char *filename) {
+	static int nested =  0;
+	const Command *cmd;
+	const char *name;
+	Statement *st;
+	Variable *alias;
+	char *args;
+	int i;
+
+	if (nested >= 10) {
+		error("eval() nested too deeply");
+		return;
+	}
+	++nested;
+	++script->running; /* an alias might redefine itself */
+
+	for (i = 0; i < script->count; ++i) {
+		st = &script->statements[i];
+		name = st->name;
+		if ((cmd = st->cmd) == NULL) {
+			if (*name == '$' && (name = set_var(&variables, name + 1, NULL)) == NULL) name = "";
+			cmd = find_command(name);
+		}
+		if (cmd != NULL) {
+			args = str_copy(st->args); /* the commands modify their arguments */
+			cmd->func(args);
+			str_free(args);
+		} else if ((alias = find_var(&aliases, name)) != NULL) {
+			run_script(alias_script(alias), name);
+		} else {
+			if (filename == NULL) error("unknown command `%s`", name);
+			else error("unknown command `%s` in file `%s` at line %d", name, filename, st->line_no);
+		}
+	}
+
 	--nested;
+	if (--script->running == 0 && script->stale) free_script(script);
+}
+
+
+void eval(const char *input, const char *filename) {
+	Script *script = compile(input);
+	run_script(script, filename);
+	free_script(script);
+}
+
+
+/* CTRL-C at the prompt cancels a menu which is still loading */
+void interrupt_prompt() {
+	if (loading == NULL) return;
+	info("cancelled `%s`", print_selector(&loading->sel, 1));
+	cancel_loading();
+}
+
+
+void enter_arrived() {
+	if (arrived == NULL) return;
+	info("`%s` is loaded, type `show` to see it", print_selector(&arrived->to, 1));
+	enter_navigation(arrived);
+	arrived = NULL;
 }
 
 
 #ifdef DELVE_USE_READLINE
-char *shell_name_generator(const char *text, int state) {
-	static int len;
-	static const Command *cmd;
-	static const Variable *alias;
-	const char *name;
+/*============================================================================*/
+int compare_completions(const void *a, const void *b) {
+	const Completion *x = a, *y = b;
+	int diff = strcmp(x->key, y->key);
+	return diff ? diff : x->id - y->id;
+}
 
-	if (!state) {
-		len = strlen(text);
-		cmd = gopher_commands;
-		alias = aliases;
+
+void add_completion(CompletionIndex *index, const char *key, const char *word, int id) {
+	size_t length = strlen(key) + 1;
+	Completion *c;
+
+	if (index->count == index->capacity) {
+		index->capacity = index->capacity ? index->capacity * 2 : 64;
+		if ((index->items = realloc(index->items, index->capacity * sizeof(Completion))) == NULL) panic("cannot allocate completions");
 	}
+	c = &index->items[index->count++];
+	c->key = str_lower(arena_alloc(&index->arena, length), length, key);
+	c->word = arena_copy(&index->arena, word);
+	c->id = id;
+}
 
-	for (; cmd->name; ++cmd) {
-		if (!strncasecmp(cmd->name, text, len)) {
-			name = cmd->name;
-			if (cmd->name) ++cmd;
-			return strdup(name);
-		}
+
+/* returns 0 when the index is still up to date, otherwise it has to be filled again */
+int reset_completions(CompletionIndex *index, int generation) {
+	if (index->generation == generation) return 0;
+	free_arena(index->arena);
+	index->arena = NULL;
+	index->count = 0;
+	index->generation = generation;
+	return 1;
+}
+
+
+void free_completions(CompletionIndex *index) {
+	free_arena(index->arena);
+	free(index->items);
+	memset(index, 0, sizeof(CompletionIndex));
+	index->generation = -1;
+}
+
+
+void sort_completions(CompletionIndex *index) {
+	qsort(index->items, index->count, sizeof(Completion), compare_completions);
+}
+
+
+void index_commands() {
+	const Command *cmd;
+	const Help *help;
+
+	if (reset_completions(&command_completions, 0)) {
+		for (cmd = gopher_commands; cmd->name; ++cmd) add_completion(&command_completions, cmd->name, cmd->name, 0);
+		sort_completions(&command_completions);
+	}
+	if (reset_completions(&topic_completions, 0)) {
+		for (help = gopher_help; help->name; ++help) add_completion(&topic_completions, help->name, help->name, 0);
+		sort_completions(&topic_completions);
 	}
+}
+
+
+void index_table(CompletionIndex *index, const Table *table) {
+	const Variable *var;
+	if (!reset_completions(index, table->generation)) return;
+	for (var = table->list; var; var = var->next) add_completion(index, var->name, var->name, 0);
+	sort_completions(index);
+}
+
+
+/* items are found by their names, with `urls` also by their URLs without "gopher://" */
+void index_selectors(CompletionIndex *index, SelectorList *list, int urls) {
+	Selector *sel;
+	char url[1024];
+	int i;
 
-	for (; alias; alias = alias->next) {
-		if (!strncasecmp(alias->name, text, len)) {
-			name = alias->name;
-			alias = alias->next;
-			return strdup(name);
+	if (!reset_completions(index, list->generation)) return;
+	for (i = 0; i < list->count; ++i) {
+		sel = &list->items[i];
+		if (strchr("3i", sel->type)) continue;
+		if (*sel->name) add_completion(index, sel->name, sel->name, i + 1);
+		if (urls) {
+			snprintf(url, sizeof(url), "%s", print_selector(sel, 1));
+			add_completion(index, url + 9, url, 0);
 		}
 	}
+	sort_completions(index);
+}
 
-	return NULL;
+
+void add_found(Found *found, const char *match) {
+	if (found->count + 2 >= found->capacity) {
+		found->capacity = found->capacity ? found->capacity * 2 : 16;
+		if ((found->matches = realloc(found->matches, found->capacity * sizeof(char*))) == NULL) panic("cannot allocate completions");
+	}
+	if ((found->matches[++found->count] = strdup(match)) == NULL) panic("cannot allocate completion");
+}
+
+
+/* adds the words or the items whose keys start with `prefix` (lower case) */
+void find_completions(Found *found, const CompletionIndex *index, const char *prefix, int items) {
+	size_t length = strlen(prefix);
+	int low = 0, high = index->count, mid;
+	const Completion *c;
+	char label[1024];
+
+	while (low < high) {
+		mid = (low + high) / 2;
+		if (strncmp(index->items[mid].key, prefix, length) < 0) low = mid + 1;
+		else high = mid;
+	}
+	for (c = &index->items[low]; c < &index->items[index->count] && !strncmp(c->key, prefix, length); ++c) {
+		if ((c->id > 0) != items) continue;
+		if (items) {
+			snprintf(label, sizeof(label), "%d %s", c->id, c->word);
+			add_found(found, label);
+			++found->items;
+		} else add_found(found, c->word);
+	}
+}
+
+
+/* words sort before items, items by their ids */
+int compare_matches(const void *a, const void *b) {
+	const char *x = *(char * const *)a, *y = *(char * const *)b;
+	int diff = atoi(x) - atoi(y);
+	return diff ? diff : strcmp(x, y);
+}
+
+
+int completes_items(const Command *cmd) {
+	return cmd->func == cmd_see || cmd->func == cmd_save || cmd->func == cmd_history || cmd->func == cmd_bookmarks;
+}
+
+
+/* where the completed text starts, `cmd` stays NULL for the command itself and the names of menu items */
+const char *completion_start(const char *line, int end, const Command **cmd) {
+	const char *word = line + strspn(line, " \t\v"), *arg, *p;
+	size_t length = strcspn(word, " \t\v");
+	char name[64];
+
+	*cmd = NULL;
+	if (line + end <= word + length) return word;
+	snprintf(name, sizeof(name), "%.*s", (int)length, word);
+	if ((*cmd = find_command(name)) == NULL) return find_var(&aliases, name) ? NULL : word;
+	if ((arg = word + length + strspn(word + length, " \t\v")) > line + end) return NULL;
+	if (completes_items(*cmd)) return arg; /* their names have spaces */
+	for (p = arg; p < line + end; ++p) if (strchr(" \t\v", *p)) return NULL; /* only the first argument */
+	return arg;
+}
+
+
+/* completes `line` up to `end`, the result is what rl_attempted_completion_function returns */
+char **complete_line(const char *line, int end) {
+	const Command *cmd;
+	const char *from = completion_start(line, end, &cmd), *tail;
+	Found found = { NULL, 0, 0, 0 };
+	char prefix[256], **match;
+	size_t lead, typed, length;
+	int i, j;
+
+	if (from == NULL) return NULL;
+	lead = from - line;
+	typed = end - lead;
+	str_lower(prefix, typed + 1 < sizeof(prefix) ? typed + 1 : sizeof(prefix), from);
+	index_commands();
+	if (cmd == NULL) {
+		index_table(&alias_completions, &aliases);
+		index_selectors(&menu_completions, &menu, 0);
+		find_completions(&found, &command_completions, prefix, 0);
+		find_completions(&found, &alias_completions, prefix, 0);
+		find_completions(&found, &menu_completions, prefix, 1);
+	} else if (cmd->func == cmd_open || cmd->func == cmd_mirror) {
+		const char *url = strncmp(prefix, "gopher://", 9) ? prefix : prefix + 9;
+		index_selectors(&history_completions, &history, 1);
+		index_selectors(&bookmark_completions, &bookmarks, 1);
+		find_completions(&found, &history_completions, url, 0);
+		find_completions(&found, &bookmark_completions, url, 0);
+	} else if (cmd->func == cmd_see || cmd->func == cmd_save) {
+		index_selectors(&menu_completions, &menu, 0);
+		find_completions(&found, &menu_completions, prefix, 1);
+	} else if (cmd->func == cmd_history) {
+		index_selectors(&history_completions, &history, 1);
+		find_completions(&found, &history_completions, prefix, 1);
+	} else if (cmd->func == cmd_bookmarks) {
+		index_selectors(&bookmark_completions, &bookmarks, 1);
+		find_completions(&found, &bookmark_completions, prefix, 1);
+	} else if (cmd->func == cmd_set) {
+		index_table(&variable_completions, &variables);
+		find_completions(&found, &variable_completions, prefix, 0);
+	} else if (cmd->func == cmd_alias) {
+		index_table(&alias_completions, &aliases);
+		find_completions(&found, &alias_completions, prefix, 0);
+	} else if (cmd->func == cmd_help) {
+		find_completions(&found, &topic_completions, prefix, 0);
+	}
+	if (found.count == 0) {
+		free(found.matches);
+		return NULL;
+	}
+
+	/* drop the duplicates, e.g. a URL which is in the history and the bookmarks */
+	match = found.matches;
+	qsort(match + 1, found.count, sizeof(char*), compare_matches);
+	for (i = j = 1; i <= found.count; ++i) {
+		if (j > 1 && !strcmp(match[j - 1], match[i])) free(match[i]);
+		else match[j++] = match[i];
+	}
+	found.count = j - 1;
+	match[found.count + 1] = NULL;
+
+	/* the whole line is replaced, see shell(): a single item becomes its id, words their common prefix */
+	if (found.count == 1) {
+		tail = match[1];
+		length = found.items ? strcspn(tail, " ") : strlen(tail);
+	} else if (found.items) {
+		tail = from; /* the ids of several items have nothing in common, so they are just listed */
+		length = typed;
+	} else {
+		for (length = strlen(match[1]), i = 2; i <= found.count; ++i) {
+			for (j = 0; (size_t)j < length && fold[(unsigned char)match[1][j]] == fold[(unsigned char)match[i][j]]; ++j) ;
+			length = j;
+		}
+		if (length < typed) {
+			tail = from;
+			length = typed;
+		} else tail = match[1];
+	}
+	if ((match[0] = malloc(lead + length + 1)) == NULL) panic("cannot allocate completion");
+	memcpy(match[0], line, lead);
+	memcpy(match[0] + lead, tail, length);
+	match[0][lead + length] = '\0';
+	if (found.count == 1) {
+		free(match[1]);
+		match[1] = NULL;
+	}
+	return match;
 }
 
+
 char **shell_name_completion(const char *text, int start, int end) {
-	(void)start; (void)end;
+	(void)text; (void)start;
 	rl_attempted_completion_over = 1;
-	return rl_completion_matches(text, shell_name_generator);
+	return complete_line(rl_line_buffer, end);
+}
+
+
+char *shell_line;
+int shell_done;
+
+
+void shell_line_handler(char *line) {
+	if (line == NULL) shell_done = 1; /* EOF */
+	shell_line = line;
+	rl_callback_handler_remove(); /* keep readline from reading ahead while the command runs */
 }
 
+
 void shell() {
-	char *line, *base, prompt[256];
+	char *line, *base;
 	Selector *to;
 
 	using_history();
 	rl_attempted_completion_function = shell_name_completion;
+	rl_completer_word_break_characters = ""; /* the whole line is completed, names of items have spaces */
+	rl_sort_completion_matches = 0; /* they are in order already, see complete_line() */
+	rl_catch_signals = 0; /* CTRL-C only cancels what we are doing, see interrupt() */
 
 	eval("open $HOME_HOLE", NULL);
 
-	for (;;) {
-		snprintf(prompt, sizeof(prompt), "(\33[35m%s\33[0m)> ", print_selector(history, 0));
-		if ((line = base = readline(prompt)) == NULL) break;
+	while (!shell_done) {
+		/* use the callback interface, so background transfers keep running while we wait for input */
+		interrupted = 0;
+		enter_arrived();
+		shell_line = NULL;
+		rl_callback_handler_install(make_prompt(), shell_line_handler);
+		at_prompt = 1;
+		while (!shell_done && shell_line == NULL) {
+			wait_for_input();
+			if (interrupted) {
+				interrupted = 0;
+				rl_replace_line("", 0);
+				puts("");
+				interrupt_prompt();
+				rl_on_new_line();
+				rl_redisplay();
+			} else rl_callback_read_char();
+		}
+		at_prompt = 0;
+		if ((line = base = shell_line) == NULL) break;
 		add_history(line);
-		if ((to = find_selector(menu, line)) != NULL) navigate(to);
+		if ((to = find_selector(&menu, line)) != NULL) navigate(to);
 		else eval(line, NULL);
 		free(base);
 	}
@@ -1040,14 +4897,243 @@ void shell() {
 
 	eval("open $HOME_HOLE", NULL);
 
-	while ((line = read_line("(\33[35m%s\33[0m)> ", print_selector(history, 0))) != NULL) {
-		if ((to = find_selector(menu, line)) != NULL) navigate(to);
+	for (;;) {
+		interrupted = 0;
+		enter_arrived();
+		at_prompt = 1;
+		line = read_line("%s", make_prompt());
+		at_prompt = 0;
+		if (line == NULL) {
+			if (!interrupted) break; /* EOF */
+			puts("");
+			interrupt_prompt();
+			continue;
+		}
+		if ((to = find_selector(&menu, line)) != NULL) navigate(to);
 		else eval(line, NULL);
 	}
 }
 #endif /* DELVE_USE_READLINE */
 
 
+/*============================================================================*/
+const char *batch_directory() {
+	const char *directory = set_var(&variables, "BATCH_DIRECTORY", NULL);
+	return directory ? directory : "";
+}
+
+
+/* <directory>/<host>[:<port>]/<path> like a mirror of every host */
+const char *batch_filename(char *buffer, size_t size, Selector *sel) {
+	char directory[1024];
+	/* hostnames don't start with a dot, so `..` can't leave the directory */
+	if (!strcmp(sel->port, "70")) snprintf(directory, sizeof(directory), "%s/%s%s", batch_directory(), *sel->host == '.' ? "_" : "", sel->host);
+	else snprintf(directory, sizeof(directory), "%s/%s%s:%s", batch_directory(), *sel->host == '.' ? "_" : "", sel->host, sel->port);
+	return mirror_filename(buffer, size, directory, sel);
+}
+
+
+void batch_done(Transfer *t) {
+	Batch *batch = t->data;
+	Result *result = &batch->results[t->sel.index % BATCH_BACKLOG];
+	char filename[1024], partial[1040];
+
+	if (*batch_directory()) {
+		close(t->out);
+		snprintf(partial, sizeof(partial), "%s.part", batch_filename(filename, sizeof(filename), &t->sel));
+		if (t->state != DONE || rename(partial, filename)) {
+			remove(partial);
+			t->state = FAILED;
+		}
+	} else if (t->state == DONE) {
+		result->buf = t->buf; /* take over the response */
+		init_buffer(&t->buf);
+		result->fd = t->temp;
+		t->temp = -1;
+	}
+	if (t->state != DONE) error("cannot fetch `%s`", print_selector(&t->sel, 1));
+	result->received = t->received;
+	result->failed = t->state != DONE;
+	result->finished = 1;
+	queue_done(t);
+}
+
+
+Transfer *start_batch(Queue *queue, Selector *sel) {
+	Batch *batch = (Batch*)queue;
+	Result *result = &batch->results[sel->index % BATCH_BACKLOG];
+	char filename[1024], partial[1040], *dir;
+	Transfer *t;
+	int fd = -1;
+
+	if (*batch_directory()) {
+		snprintf(partial, sizeof(partial), "%s.part", batch_filename(filename, sizeof(filename), sel));
+		if ((dir = strrchr(filename, '/')) != NULL) {
+			*dir = '\0';
+			make_directory(filename, 0755);
+			*dir = '/';
+		}
+		if ((fd = open(partial, O_WRONLY | O_CLOEXEC | O_CREAT | O_TRUNC, 0644)) == -1) {
+			error("cannot create file `%s`: %s", partial, strerror(errno));
+			result->finished = result->failed = 1;
+			++queue->failed;
+			return NULL;
+		}
+	}
+	t = new_transfer(sel, NULL, NULL, fd, batch_done);
+	t->sel.index = sel->index;
+	if (fd == -1) t->spill_at = (size_t)get_var_integer("MAX_MEMORY", 65536) * 1024;
+	return t;
+}
+
+
+/* writes the finished results in the order of the input, until one is still running */
+void write_results(Batch *batch) {
+	char filename[1024], buffer[1024 * 64];
+	Result *result;
+	ssize_t length;
+
+	fflush(stdout); /* the output of the commands comes first */
+	while (batch->written < batch->queued && (result = &batch->results[(batch->written + 1) % BATCH_BACKLOG])->finished) {
+		if (*batch_directory()) {
+			/* one line for every fetch: status, bytes, file and url */
+			printf("%s\t%lu\t%s\t%s\n", result->failed ? "failed" : "ok", (unsigned long)result->received,
+				batch_filename(filename, sizeof(filename), &result->sel), print_selector(&result->sel, 1));
+			fflush(stdout);
+		} else if (result->fd != -1) {
+			lseek(result->fd, 0, SEEK_SET);
+			while ((length = read(result->fd, buffer, sizeof(buffer))) > 0 && write_all(STDOUT_FILENO, buffer, length)) ;
+		} else if (!result->failed) {
+			write_all(STDOUT_FILENO, result->buf.data, result->buf.length);
+		}
+		if (result->failed) ++batch->failed;
+		if (result->fd != -1) close(result->fd);
+		free_buffer(&result->buf);
+		free_selector(&result->sel);
+		++batch->written;
+	}
+}
+
+
+/* commands wait until everything before them has been written, URLs are queued */
+int batch_line(Batch *batch, char *line) {
+	char name[64];
+	Result *result;
+	Selector sel;
+	size_t length;
+
+	line = str_skip(line, " \t\v\r");
+	if (*line == '\0' || *line == '#') return 1;
+	length = strcspn(line, " \t\v\r");
+	snprintf(name, sizeof(name), "%.*s", (int)length, line);
+	if (find_command(name) || find_var(&aliases, name)) {
+		if (batch->written < batch->queued) return 0;
+		eval(line, NULL);
+		return 1;
+	}
+
+	line[length] = '\0';
+	if (parse_selector(&sel, line) == NULL) return 1;
+	result = &batch->results[++batch->queued % BATCH_BACKLOG];
+	copy_selector(&result->sel, &sel);
+	init_buffer(&result->buf);
+	result->fd = -1;
+	result->finished = result->failed = 0;
+	result->received = 0;
+	append_selector(&batch->queue.list, &sel)->index = batch->queued;
+	start_queue(&batch->queue);
+	return 1;
+}
+
+
+/* runs the commands and fetches the URLs of a file while it is still being read */
+void batch_file(Batch *batch, const char *filename) {
+	Queue *queue = &batch->queue;
+	Buffer input;
+	char line[4096], *end;
+	size_t offset = 0, length;
+	ssize_t received;
+	int i, fd, eof = 0;
+
+	if (!strcmp(filename, "-")) fd = STDIN_FILENO;
+	else if ((fd = open(filename, O_RDONLY | O_CLOEXEC)) == -1) {
+		error("cannot open `%s`: %s", filename, strerror(errno));
+		++batch->failed;
+		return;
+	}
+	init_buffer(&input);
+
+	while (!interrupted) {
+		while (offset < input.length && batch->queued - batch->written < BATCH_BACKLOG - 1) {
+			if ((end = memchr(input.data + offset, '\n', input.length - offset)) == NULL) {
+				if (!eof) break;
+				end = input.data + input.length; /* the last line has no newline */
+			}
+			if ((length = end - input.data - offset) >= sizeof(line)) {
+				error("line too long in `%s`", filename);
+			} else {
+				memcpy(line, input.data + offset, length);
+				line[length] = '\0';
+				if (!batch_line(batch, line)) break;
+			}
+			offset += length + 1;
+		}
+		if (offset > input.length) offset = input.length;
+		write_results(batch);
+		if (eof && offset == input.length && batch->written == batch->queued) break;
+
+		/* the transfers have copies of their selectors, so the started ones can go */
+		if (queue->next >= 1024) {
+			for (i = 0; i < queue->next; ++i) free_selector(&queue->list.items[i]);
+			memmove(queue->list.items, queue->list.items + queue->next, (queue->list.count - queue->next) * sizeof(Selector));
+			queue->list.count -= queue->next;
+			queue->next = 0;
+		}
+		if (offset > 0) {
+			memmove(input.data, input.data + offset, input.length - offset);
+			input.length -= offset;
+			offset = 0;
+		}
+
+		if (engine_poll(eof || batch->queued - batch->written >= BATCH_BACKLOG - 1 ? -1 : fd, -1)) {
+			if ((received = read(fd, reserve_buffer(&input, 1024 * 64), 1024 * 64)) > 0) input.length += received;
+			else if (received == 0 || errno != EINTR) eof = 1;
+		}
+	}
+	free_buffer(&input);
+	if (fd != STDIN_FILENO) close(fd);
+}
+
+
+/* URLs are fetched side by side and written in the order of the input, see batch_line() */
+int run_batch(int count, char **files) {
+	Batch batch;
+	int i;
+
+	esc_reset = esc_info = esc_error = esc_link = esc_item = esc_pager = esc_prompt = esc_clear = "";
+	set_var(&variables, "PAGE_TEXT", "off");
+	init_queue(&batch.queue, get_var_integer("MAX_DOWNLOADS", 8), get_var_integer("MAX_HOST_DOWNLOADS", 4), start_batch);
+	batch.queued = batch.written = batch.failed = 0;
+
+	if (count == 0) batch_file(&batch, "-");
+	for (i = 0; i < count && !interrupted; ++i) batch_file(&batch, files[i]);
+
+	if (interrupted) {
+		cancel_queue(&batch.queue);
+		while (!queue_finished(&batch.queue)) engine_poll(-1, -1);
+		write_results(&batch);
+		for (batch.failed += batch.queued - batch.written; batch.written < batch.queued; ) {
+			Result *result = &batch.results[++batch.written % BATCH_BACKLOG];
+			if (result->fd != -1) close(result->fd);
+			free_buffer(&result->buf);
+			free_selector(&result->sel);
+		}
+	}
+	free_queue(&batch.queue);
+	return batch.failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+
 /*============================================================================*/
 void load_config_file(const char *filename) {
 	long length;
@@ -1088,14 +5174,18 @@ void load_config_files() {
 
 void parse_arguments(int argc, char **argv) {
 	int ch;
-	while ((ch = getopt(argc, argv, "c:")) != -1) {
+	while ((ch = getopt(argc, argv, "bc:")) != -1) {
 		switch (ch) {
+			case 'b':
+				batch = 1;
+				break;
 			case 'c':
 				load_config_file(optarg);
 				break;
 			default:
 				fprintf(stderr,
-					"usage: delve [-c config-file] [url]\n"
+					"usage: delve [-c config-file] [url]\n" \
+					"       delve -b [-c config-file] [file...]\n"
 				);
 				exit(EXIT_SUCCESS);
 				break;
@@ -1103,26 +5193,81 @@ void parse_arguments(int argc, char **argv) {
 	}
 
 	argc -= optind; argv += optind;
-	if (argc > 0) set_var(&variables, "HOME_HOLE", "%s", argv[0]);
+	if (argc > 0 && !batch) set_var(&variables, "HOME_HOLE", "%s", argv[0]);
 }
 
 
 void quit_client() {
-	free_variable(variables);
-	free_variable(aliases);
-	free_variable(typehandlers);
-	free_selector(bookmarks);
-	free_selector(history);
-	free_selector(menu);
-	puts("\33[0m");
+	Transfer *t;
+
+	save_disk_cache(); /* needs the variables for the cache directory */
+	save_index();
+#ifdef DELVE_USE_TLS
+	save_sessions();
+#endif /* DELVE_USE_TLS */
+	free_index();
+	free_queue(&prefetch);
+	cancel_loading();
+	for (t = transfers; t; t = t->next) if (t->finish == refresh_done) free_navigation(t->data);
+	while (transfers) free_transfer(transfers);
+	free_variable(&variables);
+	free_variable(&aliases);
+	free_variable(&typehandlers);
+	free_set(&command_names);
+#ifdef TCP_FASTOPEN_CONNECT
+	free_set(&fast_open_index);
+	free(fast_opens);
+#endif /* TCP_FASTOPEN_CONNECT */
+#ifdef DELVE_USE_READLINE
+	free_completions(&command_completions);
+	free_completions(&topic_completions);
+	free_completions(&alias_completions);
+	free_completions(&variable_completions);
+	free_completions(&menu_completions);
+	free_completions(&history_completions);
+	free_completions(&bookmark_completions);
+#endif /* DELVE_USE_READLINE */
+#ifdef DELVE_USE_TLS
+	free_sessions();
+#endif /* DELVE_USE_TLS */
+	close_log(&bookmarks_log);
+	close_log(&history_log);
+	free_selector_list(&bookmarks);
+	free_selector_list(&history);
+	free_set(&history_index);
+	free(history_stamps);
+	free_selector_list(&menu);
+	free_cache(cache);
+	free_disk_entry(disk_cache);
+	free_host(hosts);
+	free_buffer(&screen);
+	free(matches.items);
+	free_strings(); /* the selectors are gone */
+	if (!batch) puts(esc_reset);
 }
 
 
 int main(int argc, char **argv) {
+	struct sigaction sa;
+
+	setvbuf(stdin, NULL, _IONBF, 0); /* stdin is polled, so nothing may hide in the stdio buffer */
+	init_fold();
 	atexit(quit_client);
 
+	/* no SA_RESTART, blocking calls have to return so the transfer can be cancelled */
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = interrupt;
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGINT, &sa, NULL);
+	sa.sa_handler = resize;
+	sa.sa_flags = SA_RESTART;
+	sigaction(SIGWINCH, &sa, NULL);
+
 	load_config_files();
 	parse_arguments(argc, argv);
+	open_log(&bookmarks_log); /* after the config files, their bookmarks are not logged */
+	open_log(&history_log);
+	if (batch) return run_batch(argc - optind, argv + optind); /* the files to read */
 
 	puts(
 		"delve - 0.15.4  Copyright (C) 2019  Sebastian Steinhauer\n" \